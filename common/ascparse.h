@@ -0,0 +1,338 @@
+//
+//  ascparse -- shared .asc file reader for the IceStorm tools
+//
+//  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+//
+//  Permission to use, copy, modify, and/or distribute this software for any
+//  purpose with or without fee is hereby granted, provided that the above
+//  copyright notice and this permission notice appear in all copies.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+//  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+//  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+//  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+//  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+//  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+//  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+//
+//  Usage:
+//
+//	struct MyVisitor : AscVisitor {
+//		void asc_statement(const AscStatement &stmt) override { ... }
+//		void asc_data(const AscStatement &stmt, int data_nr, const AscToken &line) override { ... }
+//	};
+//
+//	AscFile asc;
+//	if (!asc.open(filename))   // "-" reads stdin
+//		...
+//	MyVisitor v;
+//	asc.parse(v);
+//
+//  The whole file is mapped into memory (or read into a single buffer when
+//  mapping is not possible, e.g. for pipes or on Windows) and the parser
+//  hands out pointers into that buffer. No memory is allocated per line.
+//  Alternatively asc_parse_stream() reads a FILE incrementally with bounded
+//  memory use.
+//
+//  Every line starting with '.' is a statement. All following lines up to
+//  the next statement are data lines of that statement and are passed to
+//  asc_data() together with their index (data_nr) within the statement,
+//  their line number is stmt.line_nr + data_nr + 1.
+//  Data lines before the first statement are passed with an empty keyword.
+//
+
+#ifndef ASCPARSE_H
+#define ASCPARSE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#  define ASCPARSE_MMAP
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+struct AscToken
+{
+	const char *ptr = nullptr;
+	int len = 0;
+
+	AscToken() { }
+	AscToken(const char *ptr, int len) : ptr(ptr), len(len) { }
+
+	bool empty() const { return len == 0; }
+	std::string str() const { return std::string(ptr, len); }
+
+	bool operator==(const char *s) const {
+		return strncmp(ptr, s, len) == 0 && s[len] == 0;
+	}
+
+	bool operator!=(const char *s) const {
+		return !(*this == s);
+	}
+
+	bool starts_with(const char *s) const {
+		int n = strlen(s);
+		return n <= len && memcmp(ptr, s, n) == 0;
+	}
+
+	// returns false if the token is not a (optionally negative) decimal number
+	bool to_int(int &value) const {
+		int i = 0, sign = 1;
+		value = 0;
+		if (len > 0 && ptr[0] == '-')
+			i++, sign = -1;
+		if (i == len)
+			return false;
+		for (; i < len; i++) {
+			if (ptr[i] < '0' || ptr[i] > '9')
+				return false;
+			value = value * 10 + (ptr[i] - '0');
+		}
+		value *= sign;
+		return true;
+	}
+};
+
+struct AscStatement
+{
+	static constexpr int max_args = 8;
+
+	int line_nr = 0;
+	AscToken line;
+	AscToken keyword;
+	AscToken args[max_args];
+	int nargs = 0;
+
+	// integer argument, -1 if missing or not a number
+	int int_arg(int idx) const {
+		int value;
+		if (idx >= nargs || !args[idx].to_int(value))
+			return -1;
+		return value;
+	}
+};
+
+struct AscVisitor
+{
+	virtual ~AscVisitor() { }
+	virtual void asc_statement(const AscStatement &) { }
+	virtual void asc_data(const AscStatement &, int /* data_nr */, const AscToken & /* line */) { }
+};
+
+// value of a hex digit, -1 for other characters
+inline int asc_hex_digit(char c)
+{
+	static const signed char table[256] = {
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+		-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	};
+	return table[(unsigned char)c];
+}
+
+// Pack the leading '0'/'1' characters of a config bits line into a word,
+// first character in bit 0. Returns the number of bits, or -1 if there
+// are more than 64.
+inline int asc_bits_row(const AscToken &line, uint64_t &word)
+{
+	int i;
+	word = 0;
+	for (i = 0; i < line.len && (line.ptr[i] == '0' || line.ptr[i] == '1'); i++) {
+		if (i == 64)
+			return -1;
+		word |= uint64_t(line.ptr[i] - '0') << i;
+	}
+	return i;
+}
+
+// Line level parser state shared by AscFile::parse() and asc_parse_stream().
+// With copy_statements set, statement lines are copied so that the tokens in
+// the AscStatement stay valid after the line buffer is reused.
+struct AscLineParser
+{
+	AscVisitor &visitor;
+	bool copy_statements;
+
+	AscStatement stmt;
+	std::string stmt_buffer;
+	int line_nr = 0, data_nr = 0;
+
+	AscLineParser(AscVisitor &visitor, bool copy_statements = false) :
+			visitor(visitor), copy_statements(copy_statements) { }
+
+	void line(const char *p, int len)
+	{
+		line_nr++;
+
+		if (len > 0 && p[len-1] == '\r')
+			len--;
+
+		if (len == 0 || p[0] != '.') {
+			visitor.asc_data(stmt, data_nr++, AscToken(p, len));
+			return;
+		}
+
+		if (copy_statements) {
+			stmt_buffer.assign(p, len);
+			p = stmt_buffer.data();
+		}
+
+		stmt.line_nr = line_nr;
+		stmt.line = AscToken(p, len);
+		stmt.nargs = 0;
+
+		int i = 0;
+		for (int field = 0; i < len; field++) {
+			while (i < len && (p[i] == ' ' || p[i] == '\t'))
+				i++;
+			if (i == len)
+				break;
+			int start = i;
+			while (i < len && p[i] != ' ' && p[i] != '\t')
+				i++;
+			if (field == 0)
+				stmt.keyword = AscToken(p + start, i - start);
+			else if (stmt.nargs < AscStatement::max_args)
+				stmt.args[stmt.nargs++] = AscToken(p + start, i - start);
+		}
+
+		data_nr = 0;
+		visitor.asc_statement(stmt);
+	}
+};
+
+struct AscFile
+{
+	const char *data = nullptr;
+	size_t size = 0;
+
+	AscFile() { }
+	AscFile(const AscFile &) = delete;
+	AscFile &operator=(const AscFile &) = delete;
+
+	~AscFile() {
+		close();
+	}
+
+	// Open and load a file ("-" for stdin). Returns false and leaves
+	// errno set if the file can't be opened or read.
+	bool open(const char *filename)
+	{
+		close();
+
+		bool use_stdin = !strcmp(filename, "-");
+		FILE *f = use_stdin ? stdin : fopen(filename, "rb");
+		if (f == nullptr)
+			return false;
+
+#ifdef ASCPARSE_MMAP
+		struct stat st;
+		if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+			if (p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				data = (const char*)p;
+				size = st.st_size;
+				mapped = true;
+				if (!use_stdin)
+					fclose(f);
+				return true;
+			}
+		}
+#endif
+
+		char chunk[65536];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+			buffer.insert(buffer.end(), chunk, chunk + n);
+
+		bool ok = !ferror(f);
+		if (!use_stdin)
+			fclose(f);
+
+		data = buffer.data();
+		size = buffer.size();
+		return ok;
+	}
+
+	void close()
+	{
+#ifdef ASCPARSE_MMAP
+		if (mapped)
+			munmap((void*)data, size);
+#endif
+		mapped = false;
+		buffer.clear();
+		data = nullptr;
+		size = 0;
+	}
+
+	void parse(AscVisitor &visitor) const
+	{
+		AscLineParser parser(visitor);
+
+		const char *p = data, *end = data + size;
+		while (p < end)
+		{
+			const char *eol = (const char*)memchr(p, '\n', end - p);
+			if (eol == nullptr)
+				eol = end;
+
+			parser.line(p, eol - p);
+			p = eol + 1;
+		}
+	}
+
+private:
+	bool mapped = false;
+	std::vector<char> buffer;
+};
+
+// Parse a file incrementally. Only the current line (and a fixed size read
+// buffer) is kept in memory, so this can be used to stream large files from
+// pipes. Returns false on read errors.
+inline bool asc_parse_stream(FILE *f, AscVisitor &visitor)
+{
+	AscLineParser parser(visitor, true);
+	std::vector<char> buffer(65536);
+	size_t used = 0;
+
+	while (1)
+	{
+		if (used == buffer.size())
+			buffer.resize(2 * buffer.size());
+
+		size_t n = fread(buffer.data() + used, 1, buffer.size() - used, f);
+		used += n;
+
+		const char *p = buffer.data(), *end = buffer.data() + used;
+		while (const char *eol = (const char*)memchr(p, '\n', end - p)) {
+			parser.line(p, eol - p);
+			p = eol + 1;
+		}
+
+		if (n == 0) {
+			if (p < end)
+				parser.line(p, end - p);
+			return !ferror(f);
+		}
+
+		used = end - p;
+		memmove(buffer.data(), p, used);
+	}
+}
+
+#endif
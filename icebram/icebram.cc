@@ -23,91 +23,750 @@
 #include <sys/time.h>
 
 #include <map>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
 #include <vector>
 #include <string>
-#include <fstream>
-#include <iostream>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
+#include "../common/ascparse.h"
+
 using std::map;
 using std::pair;
+using std::set;
 using std::vector;
 using std::string;
-using std::ifstream;
-using std::getline;
 
 uint64_t x;
-uint64_t xorshift64star(void) {
+uint64_t xorshift64star(uint64_t &x = ::x) {
 	x ^= x >> 12; // a
 	x ^= x << 25; // b
 	x ^= x >> 27; // c
 	return x * UINT64_C(2685821657736338717);
 }
 
-void push_back_bitvector(vector<vector<bool>> &hexfile, const vector<int> &digits)
+uint64_t splitmix64(uint64_t z) {
+	z += UINT64_C(0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+// One bit of each of the 256 words of a 256x16 BRAM block, bit j of the
+// slice is the bit of word j.
+struct bitslice_t
 {
-	if (digits.empty())
-		return;
+	uint64_t w[4];
+
+	bool operator==(const bitslice_t &other) const {
+		return w[0] == other.w[0] && w[1] == other.w[1] && w[2] == other.w[2] && w[3] == other.w[3];
+	}
+
+	uint64_t hash() const {
+		uint64_t h = w[0];
+		h = (h ^ (h >> 29)) * UINT64_C(0xbf58476d1ce4e5b9) ^ w[1];
+		h = (h ^ (h >> 29)) * UINT64_C(0xbf58476d1ce4e5b9) ^ w[2];
+		h = (h ^ (h >> 29)) * UINT64_C(0xbf58476d1ce4e5b9) ^ w[3];
+		return h ^ (h >> 32);
+	}
+};
+
+// Open addressing (linear probing) table from_slice -> (index in the
+// pattern, replace count)
+struct slice_table_t
+{
+	struct entry_t {
+		bitslice_t from;
+		int index;
+		int count;
+		bool used;
+	};
+
+	vector<entry_t> entries;
+	uint64_t mask = 0;
+	int size = 0;
+
+	void reserve(int n)
+	{
+		uint64_t cap = 16;
+		while (cap < 2 * uint64_t(n))
+			cap *= 2;
+		entries.assign(cap, entry_t());
+		mask = cap - 1;
+		size = 0;
+	}
+
+	entry_t *find(const bitslice_t &key)
+	{
+		for (uint64_t i = key.hash() & mask;; i = (i + 1) & mask) {
+			if (!entries[i].used)
+				return nullptr;
+			if (entries[i].from == key)
+				return &entries[i];
+		}
+	}
 
-	hexfile.push_back(vector<bool>(digits.size() * 4));
+	// returns false if the key is already in the table
+	bool insert(const bitslice_t &from, int index)
+	{
+		assert(2 * (size + 1) <= int(entries.size()));
+		uint64_t i = from.hash() & mask;
+		for (; entries[i].used; i = (i + 1) & mask)
+			if (entries[i].from == from)
+				return false;
+		entries[i].from = from;
+		entries[i].index = index;
+		entries[i].count = 0;
+		entries[i].used = true;
+		size++;
+		return true;
+	}
+};
 
-	for (int i = 0; i < int(digits.size()) * 4; i++)
-		if ((digits.at(digits.size() - i/4 -1) & (1 << (i%4))) != 0)
-			hexfile.back().at(i) = true;
+// Transpose a 16x16 bit matrix: afterwards bit i of m[k] is what was bit k
+// of m[i]. This turns 16 consecutive BRAM words into 16 bits of each of the
+// 16 bitslices, and (being its own inverse) back.
+static inline void transpose16(uint16_t m[16])
+{
+	uint16_t mask = 0x00ff;
+	for (int j = 8; j != 0; j >>= 1, mask ^= mask << j)
+		for (int k = 0; k < 16; k = ((k | j) + 1) & ~j) {
+			uint16_t t = ((m[k] >> j) ^ m[k | j]) & mask;
+			m[k] ^= t << j;
+			m[k | j] ^= t;
+		}
 }
 
-void parse_hexfile_line(const char *filename, int linenr, vector<vector<bool>> &hexfile, string &line)
+// Extract the 16 bitslices of a 256x16 memory block
+static void words_to_slices(const uint16_t words[256], bitslice_t slices[16])
+{
+	for (int i = 0; i < 16; i++)
+		slices[i] = bitslice_t();
+
+	for (int r = 0; r < 16; r++) {
+		uint16_t m[16];
+		for (int k = 0; k < 16; k++)
+			m[k] = words[16*r + k];
+		transpose16(m);
+		for (int i = 0; i < 16; i++)
+			slices[i].w[r / 4] |= uint64_t(m[i]) << (16 * (r % 4));
+	}
+}
+
+static void slices_to_words(const bitslice_t slices[16], uint16_t words[256])
+{
+	for (int r = 0; r < 16; r++) {
+		uint16_t m[16];
+		for (int i = 0; i < 16; i++)
+			m[i] = slices[i].w[r / 4] >> (16 * (r % 4));
+		transpose16(m);
+		for (int k = 0; k < 16; k++)
+			words[16*r + k] = m[k];
+	}
+}
+
+// Contents of a .ram_data block: 16 lines of 64 hex digits, the last four
+// digits of line r are word 16*r, the first four are word 16*r+15.
+struct bram_data_t
+{
+	uint16_t words[256];
+	int lines = 0;
+};
+
+void parse_ram_data_line(int linenr, bram_data_t &bram, const char *line, int len)
+{
+	if (bram.lines == 16 || len != 64)
+		goto error;
+
+	for (int k = 0; k < 16; k++) {
+		uint16_t word = 0;
+		for (int i = 0; i < 4; i++) {
+			int digit = asc_hex_digit(line[60 - 4*k + i]);
+			if (digit < 0)
+				goto error;
+			word = (word << 4) | digit;
+		}
+		bram.words[16*bram.lines + k] = word;
+	}
+
+	bram.lines++;
+	return;
+
+error:
+	fprintf(stderr, "Can't parse line %d of stdin: %.*s\n", linenr, len, line);
+	exit(1);
+}
+
+// The bitslices of one BRAM block and the pattern index each of them
+// matched (-1 for none)
+struct bram_match_t
+{
+	bitslice_t slices[16];
+	int index[16];
+	bool matched;
+};
+
+void match_bram_data(slice_table_t &pattern, const uint16_t words[256], bram_match_t &match, int &max_replace_cnt)
+{
+	words_to_slices(words, match.slices);
+	match.matched = false;
+
+	for (int i = 0; i < 16; i++)
+	{
+		auto p = pattern.find(match.slices[i]);
+		match.index[i] = -1;
+		if (p != nullptr)
+		{
+			match.index[i] = p->index;
+			match.matched = true;
+			max_replace_cnt = std::max(++p->count, max_replace_cnt);
+		}
+	}
+}
+
+// Write the BRAM contents for one to_hexfile, returns false if nothing matched
+bool apply_bram_match(const bram_match_t &match, const vector<bitslice_t> &to_slices, uint16_t words[256])
+{
+	if (!match.matched)
+		return false;
+
+	bitslice_t slices[16];
+	for (int i = 0; i < 16; i++)
+		slices[i] = match.index[i] < 0 ? match.slices[i] : to_slices[match.index[i]];
+
+	slices_to_words(slices, words);
+	return true;
+}
+
+// -------------------------------------------------------
+// Binary bitstreams (see FpgaConfig::read_bits() and BramIndexConverter in
+// icepack). BRAM bank data is stored row by row, MSB first. Within a bank,
+// BRAM block n uses the columns 16*n .. 16*n+15 and word a of the block is
+// stored in row a, with bit i in column 16*n+15-i. So each word is a big
+// endian 16 bit value at byte offset 2*n of its row.
+
+bool is_bitstream(const char *data, size_t size)
+{
+	return size > 0 && (uint8_t(data[0]) == 0xff || uint8_t(data[0]) == 0x7e);
+}
+
+static void update_crc16(uint16_t &crc, uint8_t byte)
+{
+	// CRC-16-CCITT, Initialize to 0xFFFF, No zero padding
+	for (int i = 7; i >= 0; i--) {
+		uint16_t xor_value = ((crc >> 15) ^ ((byte >> i) & 1)) ? 0x1021 : 0;
+		crc = (crc << 1) ^ xor_value;
+	}
+}
+
+// Positions of the BRAM blocks and CRC check values in a bitstream
+struct bitstream_layout_t
+{
+	// bram_words[n][a] = offset of word a of BRAM block n in the bitstream
+	vector<vector<size_t>> bram_words;
+
+	// (crc reset position, crc value position) pairs
+	vector<pair<size_t, size_t>> crc_checks;
+
+	void read_words(const vector<uint8_t> &bin, int n, uint16_t words[256]) const
+	{
+		for (int a = 0; a < 256; a++)
+			words[a] = (bin[bram_words[n][a]] << 8) | bin[bram_words[n][a] + 1];
+	}
+
+	void write_words(vector<uint8_t> &bin, int n, const uint16_t words[256]) const
+	{
+		for (int a = 0; a < 256; a++) {
+			bin[bram_words[n][a]] = words[a] >> 8;
+			bin[bram_words[n][a] + 1] = words[a];
+		}
+	}
+
+	void update_crc(vector<uint8_t> &bin) const
+	{
+		for (auto &it : crc_checks) {
+			uint16_t crc_value = 0xffff;
+			for (size_t i = it.first; i < it.second; i++)
+				update_crc16(crc_value, bin[i]);
+			bin[it.second] = crc_value >> 8;
+			bin[it.second + 1] = crc_value;
+		}
+	}
+};
+
+void parse_bitstream(const vector<uint8_t> &bin, bitstream_layout_t &layout)
+{
+	size_t pos = 0;
+	uint32_t preamble = 0;
+
+	while (preamble != 0x7EAA997E) {
+		if (pos == bin.size()) {
+			fprintf(stderr, "No preamble found in bitstream.\n");
+			exit(1);
+		}
+		preamble = (preamble << 8) | bin[pos++];
+	}
+
+	// bram_rows[bank][row] = offset of the row in bin, bram_width[bank][row] = its width in bits
+	vector<vector<size_t>> bram_rows(4, vector<size_t>(256));
+	vector<vector<int>> bram_width(4, vector<int>(256));
+
+	size_t crc_start = pos;
+
+	int current_bank = 0, current_width = 0, current_height = 0, current_offset = 0;
+	bool wakeup = false;
+
+	while (!wakeup)
+	{
+		if (pos == bin.size())
+			goto truncated;
+
+		uint8_t command = bin[pos++];
+		uint32_t payload = 0;
+		size_t payload_pos = pos;
+
+		for (int i = 0; i < (command & 0x0f); i++) {
+			if (pos == bin.size())
+				goto truncated;
+			payload = (payload << 8) | bin[pos++];
+		}
+
+		switch (command & 0xf0)
+		{
+		case 0x00:
+			if (payload == 0x01 || payload == 0x03) {
+				size_t nbytes = size_t(current_width) * current_height / 8;
+				if (pos + nbytes + 2 > bin.size())
+					goto truncated;
+				if (payload == 0x03) {
+					if (current_width % 16 != 0 || current_bank > 3 || current_offset + current_height > 256) {
+						fprintf(stderr, "Unsupported BRAM data layout in bitstream.\n");
+						exit(1);
+					}
+					for (int y = 0; y < current_height; y++) {
+						bram_rows[current_bank][current_offset + y] = pos + y * current_width / 8;
+						bram_width[current_bank][current_offset + y] = current_width;
+					}
+				}
+				pos += nbytes + 2;
+			}
+			if (payload == 0x05)
+				crc_start = pos;
+			if (payload == 0x06)
+				wakeup = true;
+			break;
+		case 0x10:
+			current_bank = payload;
+			break;
+		case 0x20:
+			if ((command & 0x0f) == 2)
+				layout.crc_checks.push_back(std::make_pair(crc_start, payload_pos));
+			break;
+		case 0x60:
+			current_width = payload + 1;
+			break;
+		case 0x70:
+			current_height = payload;
+			break;
+		case 0x80:
+			current_offset = payload;
+			break;
+		}
+	}
+
+	for (int bank = 0; bank < 4; bank++)
+	{
+		int width = *std::min_element(bram_width[bank].begin(), bram_width[bank].end());
+
+		for (int n = 0; n < width / 16; n++) {
+			layout.bram_words.push_back(vector<size_t>(256));
+			for (int a = 0; a < 256; a++)
+				layout.bram_words.back()[a] = bram_rows[bank][a] + 2*n;
+		}
+	}
+	return;
+
+truncated:
+	fprintf(stderr, "Unexpected end of bitstream.\n");
+	exit(1);
+}
+
+void write_bram_data(FILE *f, const uint16_t words[256])
+{
+	for (int r = 0; r < 16; r++) {
+		char buffer[66];
+		for (int k = 15; k >= 0; k--)
+			snprintf(buffer + 60 - 4*k, 5, "%04x", words[16*r + k]);
+		buffer[64] = '\n';
+		fwrite(buffer, 1, 65, f);
+	}
+}
+
+// Streaming mode: copy the asc file to all outputs as it is read, substituting
+// each .ram_data block as soon as all of its lines are available
+struct AscRamStreamer : AscVisitor
+{
+	slice_table_t &pattern;
+	const vector<vector<bitslice_t>> &to_slices;
+	const vector<FILE*> &outputs;
+	int &max_replace_cnt;
+
+	bram_data_t bram;
+	bool in_bram = false;
+	int num_brams = 0;
+
+	AscRamStreamer(slice_table_t &pattern, const vector<vector<bitslice_t>> &to_slices,
+			const vector<FILE*> &outputs, int &max_replace_cnt) :
+			pattern(pattern), to_slices(to_slices), outputs(outputs), max_replace_cnt(max_replace_cnt) { }
+
+	void end_bram(int linenr)
+	{
+		if (in_bram && bram.lines != 16) {
+			fprintf(stderr, "Incomplete BRAM data before line %d of stdin!\n", linenr);
+			exit(1);
+		}
+		in_bram = false;
+	}
+
+	void write_line(const AscToken &line)
+	{
+		for (auto f : outputs) {
+			fwrite(line.ptr, 1, line.len, f);
+			fputc('\n', f);
+		}
+	}
+
+	void asc_statement(const AscStatement &stmt) override
+	{
+		end_bram(stmt.line_nr);
+		write_line(stmt.line);
+
+		if (stmt.keyword == ".ram_data") {
+			bram.lines = 0;
+			in_bram = true;
+			num_brams++;
+		}
+	}
+
+	void asc_data(const AscStatement &stmt, int data_nr, const AscToken &line) override
+	{
+		if (!in_bram) {
+			write_line(line);
+			return;
+		}
+
+		parse_ram_data_line(stmt.line_nr + data_nr + 1, bram, line.ptr, line.len);
+
+		if (bram.lines == 16) {
+			bram_match_t match;
+			match_bram_data(pattern, bram.words, match, max_replace_cnt);
+			for (int v = 0; v < int(outputs.size()); v++) {
+				uint16_t words[256];
+				std::copy_n(bram.words, 256, words);
+				apply_bram_match(match, to_slices[v], words);
+				write_bram_data(outputs[v], words);
+			}
+		}
+	}
+};
+
+struct AscRamReader : AscVisitor
+{
+	vector<string> &ascfile_lines;
+	map<string, bram_data_t> &ascfile_hexdata;
+	bram_data_t *bram = nullptr;
+
+	AscRamReader(vector<string> &ascfile_lines, map<string, bram_data_t> &ascfile_hexdata) :
+			ascfile_lines(ascfile_lines), ascfile_hexdata(ascfile_hexdata) { }
+
+	void asc_statement(const AscStatement &stmt) override
+	{
+		ascfile_lines.push_back(stmt.line.str());
+		bram = stmt.keyword == ".ram_data" ? &ascfile_hexdata[ascfile_lines.back()] : nullptr;
+	}
+
+	void asc_data(const AscStatement &stmt, int data_nr, const AscToken &line) override
+	{
+		if (bram != nullptr)
+			parse_ram_data_line(stmt.line_nr + data_nr + 1, *bram, line.ptr, line.len);
+		else
+			ascfile_lines.push_back(line.str());
+	}
+};
+
+// A hexfile as packed words: bits 64*k .. 64*k+63 of word a are stored in
+// data[a * stride + k]
+struct hexfile_t
 {
-	vector<int> digits;
-
-	for (char c : line) {
-		if ('0' <= c && c <= '9')
-			digits.push_back(c - '0');
-		else if ('a' <= c && c <= 'f')
-			digits.push_back(10 + c - 'a');
-		else if ('A' <= c && c <= 'F')
-			digits.push_back(10 + c - 'A');
-		else if ('x' == c || 'X' == c ||
-			 'z' == c || 'Z' == c)
-			digits.push_back(0);
-		else if ('_' == c)
-			;
-		else if (' ' == c || '\t' == c || '\r' == c) {
-			push_back_bitvector(hexfile, digits);
-			digits.clear();
-		} else goto error;
-	}
-
-	push_back_bitvector(hexfile, digits);
+	int width = 0, depth = 0, stride = 0;
+	vector<uint64_t> data;
+
+	// bits col .. col+15 of word a, col must be a multiple of 16
+	uint16_t get16(int a, int col) const {
+		return data[size_t(a) * stride + col / 64] >> (col % 64);
+	}
+};
+
+// Load a $readmemh style hexfile: whitespace separated words of hex digits,
+// '_' is ignored and 'x'/'z' digits are read as 0. All words must have the
+// width of the first word, with pad_words narrower words are zero extended.
+void load_hexfile(const char *filename, hexfile_t &hexfile, bool pad_words)
+{
+	AscFile f;
+	if (!f.open(filename)) {
+		fprintf(stderr, "Can't open hexfile %s!\n", filename);
+		exit(1);
+	}
+
+	vector<uint8_t> digits;
+	const char *p = f.data, *end = f.data + f.size;
+	const char *line = p;
+	int linenr = 1;
+
+	while (p < end)
+	{
+		// skip whitespace, count lines
+		if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			if (*p == '\n')
+				line = p + 1, linenr++;
+			p++;
+			continue;
+		}
+
+		// decode one word
+		digits.clear();
+		for (; p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'; p++) {
+			int digit = asc_hex_digit(*p);
+			if (digit >= 0)
+				digits.push_back(digit);
+			else if (*p == 'x' || *p == 'X' || *p == 'z' || *p == 'Z')
+				digits.push_back(0);
+			else if (*p != '_')
+				goto error;
+		}
+
+		if (digits.empty())
+			continue;
+
+		if (hexfile.depth == 0) {
+			hexfile.width = 4 * digits.size();
+			hexfile.stride = (hexfile.width + 63) / 64;
+			// estimate the number of words from the file size
+			hexfile.data.reserve(f.size / (digits.size() + 1) * hexfile.stride + hexfile.stride);
+		}
+
+		if (4 * int(digits.size()) != hexfile.width && (!pad_words || 4 * int(digits.size()) > hexfile.width)) {
+			fprintf(stderr, "Inconsistent word width at line %d of %s!\n", linenr, filename);
+			exit(1);
+		}
+
+		hexfile.data.resize(hexfile.data.size() + hexfile.stride);
+		uint64_t *word = &hexfile.data[size_t(hexfile.depth) * hexfile.stride];
+		for (int i = 0, n = digits.size(); i < n; i++) {
+			int pos = 4 * (n - 1 - i);
+			word[pos / 64] |= uint64_t(digits[i]) << (pos % 64);
+		}
+		hexfile.depth++;
+	}
 
 	return;
 
 error:
-	fprintf(stderr, "Can't parse line %d of %s: %s\n", linenr, filename, line.c_str());
+	const char *eol = (const char*)memchr(line, '\n', end - line);
+	fprintf(stderr, "Can't parse line %d of %s: %.*s\n", linenr, filename, int((eol ? eol : end) - line), line);
 	exit(1);
 }
 
+// Bitslices of a hexfile, slices[c * (depth / 256) + b] is column c of the
+// 256 word block b
+void make_slices(const hexfile_t &hexfile, vector<bitslice_t> &slices)
+{
+	int num_blocks = hexfile.depth / 256;
+	slices.resize(hexfile.width * num_blocks);
+
+	for (int i = 0; i < hexfile.width; i += 16)
+	for (int b = 0; b < num_blocks; b++)
+	{
+		uint16_t words[256];
+		bitslice_t block_slices[16];
+
+		for (int j = 0; j < 256; j++)
+			words[j] = hexfile.get16(256*b + j, i);
+
+		words_to_slices(words, block_slices);
+
+		for (int k = 0; k < 16 && i + k < hexfile.width; k++)
+			slices[(i + k) * num_blocks + b] = block_slices[k];
+	}
+}
+
+// Run func(0) .. func(n-1) on up to num_threads threads
+void parallel_for(int n, int num_threads, const std::function<void(int)> &func)
+{
+#ifndef __EMSCRIPTEN__
+	if (num_threads > 1 && n > 1) {
+		std::atomic<int> next(0);
+		vector<std::thread> threads;
+		for (int t = 0; t < std::min(n, num_threads); t++)
+			threads.push_back(std::thread([&]() {
+				for (int i = next++; i < n; i = next++)
+					func(i);
+			}));
+		for (auto &t : threads)
+			t.join();
+		return;
+	}
+#endif
+	for (int i = 0; i < n; i++)
+		func(i);
+}
+
+// Fill a hexfile with random data. Every 256 word block gets its own
+// xorshift64* stream, seeded from (seed, block, attempt) with splitmix64, so
+// blocks can be generated in parallel and the result does not depend on the
+// number of threads. Blocks are regenerated until all bitslices are unique
+// and non-zero, as required for from_hexfile.
+void generate_hexfile(hexfile_t &hexfile, int width, int depth, uint64_t seed, int num_threads)
+{
+	hexfile.width = width;
+	hexfile.depth = depth;
+	hexfile.stride = (width + 63) / 64;
+	hexfile.data.assign(size_t(depth) * hexfile.stride, 0);
+
+	int num_blocks = depth / 256;
+	vector<int> attempts(num_blocks);
+
+	uint64_t last_mask = width % 64 == 0 ? ~uint64_t(0) : (uint64_t(1) << (width % 64)) - 1;
+
+	auto generate_block = [&](int b) {
+		uint64_t state = splitmix64(seed ^ splitmix64((uint64_t(b) << 16) | attempts[b]));
+		if (state == 0)
+			state = 1;
+		uint64_t *p = &hexfile.data[size_t(b) * 256 * hexfile.stride];
+		for (int i = 0; i < 256; i++, p += hexfile.stride) {
+			for (int k = 0; k < hexfile.stride; k++)
+				p[k] = xorshift64star(state);
+			p[hexfile.stride - 1] &= last_mask;
+		}
+	};
+
+	parallel_for(num_blocks, num_threads, generate_block);
+
+	while (1)
+	{
+		vector<bitslice_t> slices;
+		make_slices(hexfile, slices);
+
+		slice_table_t table;
+		table.reserve(slices.size());
+
+		int bad = -1;
+		for (int n = 0; n < int(slices.size()) && bad < 0; n++)
+			if (slices[n] == bitslice_t() || !table.insert(slices[n], n))
+				bad = n;
+
+		if (bad < 0)
+			break;
+
+		int b = bad % num_blocks;
+		attempts[b]++;
+		generate_block(b);
+	}
+}
+
+// Write a hexfile, the text is formatted in parallel into one buffer
+void write_hexfile(FILE *f, const hexfile_t &hexfile, int num_threads)
+{
+	int digits = hexfile.width / 4;
+	size_t line_len = digits + 1;
+	vector<char> buffer(line_len * hexfile.depth);
+
+	parallel_for(hexfile.depth / 256, num_threads, [&](int b) {
+		for (int a = 256*b; a < 256*b + 256; a++) {
+			char *p = &buffer[line_len * a];
+			const uint64_t *word = &hexfile.data[size_t(a) * hexfile.stride];
+			for (int i = 0; i < digits; i++) {
+				int pos = 4 * (digits - 1 - i);
+				p[i] = "0123456789abcdef"[(word[pos / 64] >> (pos % 64)) & 15];
+			}
+			p[digits] = '\n';
+		}
+	});
+
+	if (fwrite(buffer.data(), 1, buffer.size(), f) != buffer.size()) {
+		perror("Can't write hexfile");
+		exit(1);
+	}
+}
+
+// Output file name for to_hexfile: '%s' in the template is replaced by the
+// name of the to_hexfile without directory and extension, '%p' by its path
+// without extension
+string output_filename(const string &output_template, const string &to_hexfile_n)
+{
+	size_t dir_len = to_hexfile_n.find_last_of("/\\") + 1;
+	size_t ext_pos = to_hexfile_n.find_last_of('.');
+	string path = ext_pos != string::npos && ext_pos >= dir_len ? to_hexfile_n.substr(0, ext_pos) : to_hexfile_n;
+	string name = path.substr(dir_len);
+
+	string filename = output_template;
+	size_t pos = filename.find("%s");
+	if (pos != string::npos)
+		filename.replace(pos, 2, name);
+	pos = filename.find("%p");
+	if (pos != string::npos)
+		filename.replace(pos, 2, path);
+	return filename;
+}
+
 void help(const char *cmd)
 {
 	printf("\n");
 	printf("Usage: %s [options] <from_hexfile> <to_hexfile>\n", cmd);
+	printf("       %s [options] -o <output_template> <from_hexfile> <to_hexfile>...\n", cmd);
 	printf("       %s [options] -g [-s <seed>] <width> <depth>\n", cmd);
 	printf("\n");
 	printf("Replace BRAM initialization data in a .asc file. This can be used\n");
 	printf("for example to replace firmware images without re-running synthesis\n");
 	printf("and place&route.\n");
 	printf("\n");
+	printf("The file on stdin can also be a binary bitstream (as written by\n");
+	printf("icepack), it is then patched in place and written as bitstream.\n");
+	printf("\n");
+	printf("With more than one <to_hexfile>, the input is read and matched against\n");
+	printf("<from_hexfile> once and one output is written per <to_hexfile>.\n");
+	printf("\n");
+	printf("    -o <output_template>\n");
+	printf("        write the output to this file instead of stdout. '%%s' in the\n");
+	printf("        name is replaced by the name of the <to_hexfile> (without\n");
+	printf("        directory and extension), '%%p' by its path without extension.\n");
+	printf("        One of them is required for multiple <to_hexfile>s, and the\n");
+	printf("        resulting names must be distinct.\n");
+	printf("\n");
+	printf("    -j <threads>\n");
+	printf("        number of threads used for writing outputs and for -g\n");
+	printf("        (default: number of CPUs)\n");
+	printf("\n");
 	printf("    -g\n");
 	printf("        generate a hex file with random contents.\n");
 	printf("        use this to generate the hex file used during synthesis, then\n");
-	printf("        use the same file as <from_hexfile> later.\n");
+	printf("        use the same file as <from_hexfile> later. the generated\n");
+	printf("        bit slices are guaranteed to be unique and non-zero.\n");
 	printf("\n");
 	printf("    -s <seed>\n");
 	printf("        seed random generator with fixed value.\n");
 	printf("\n");
+	printf("    -S\n");
+	printf("        streaming mode: write the .asc file while it is read, only one\n");
+	printf("        BRAM block is held in memory. On errors the output written so\n");
+	printf("        far is incomplete and must be discarded.\n");
+	printf("\n");
 	printf("    -v\n");
 	printf("        verbose output\n");
 	printf("\n");
@@ -130,14 +789,26 @@ int main(int argc, char **argv)
 
 	bool verbose = false;
 	bool generate = false;
+	bool stream = false;
+	string output_template;
+	int num_threads = std::max(1u, std::thread::hardware_concurrency());
 	bool seed = false;
 	uint32_t seed_nr = getpid();
 
 	int opt;
-	while ((opt = getopt(argc, argv, "vgs:")) != -1)
+	while ((opt = getopt(argc, argv, "vgs:So:j:")) != -1)
 	{
 		switch (opt)
 		{
+		case 'o':
+			output_template = optarg;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		case 'S':
+			stream = true;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -197,174 +868,219 @@ int main(int argc, char **argv)
 		xorshift64star();
 		xorshift64star();
 
-		for (int i = 0; i < depth; i++) {
-			for (int j = 0; j < width / 4; j++) {
-				int digit = xorshift64star() & 15;
-				std::cout << "0123456789abcdef"[digit];
-			}
-			std::cout << std::endl;
-		}
+		hexfile_t hexfile;
+		generate_hexfile(hexfile, width, depth, x, num_threads);
+		write_hexfile(stdout, hexfile, num_threads);
 
 		exit(0);
 	}
 
-	if (optind+2 != argc)
+	if (optind+2 > argc)
 		help(argv[0]);
 
+	int num_outputs = argc - optind - 1;
 
-	// -------------------------------------------------------
-	// Load from_hexfile and to_hexfile
-
-	const char *from_hexfile_n = argv[optind];
-	ifstream from_hexfile_f(from_hexfile_n);
-	vector<vector<bool>> from_hexfile;
+	if (num_outputs > 1 && output_template.find("%s") == string::npos && output_template.find("%p") == string::npos) {
+		fprintf(stderr, "Multiple to_hexfiles need an output template containing '%%s' or '%%p' (-o)!\n");
+		exit(1);
+	}
 
-	const char *to_hexfile_n = argv[optind+1];
-	ifstream to_hexfile_f(to_hexfile_n);
-	vector<vector<bool>> to_hexfile;
+	vector<string> output_names;
+	set<string> output_names_seen;
 
-	string line;
+	for (int v = 0; v < num_outputs; v++) {
+		if (output_template.empty()) {
+			output_names.push_back("stdout");
+			continue;
+		}
+		output_names.push_back(output_filename(output_template, argv[optind+1+v]));
+		if (!output_names_seen.insert(output_names.back()).second) {
+			fprintf(stderr, "Output file %s is used for more than one to_hexfile, use '%%p' in the template!\n",
+					output_names.back().c_str());
+			exit(1);
+		}
+	}
 
-	for (int i = 1; getline(from_hexfile_f, line); i++)
-		parse_hexfile_line(from_hexfile_n, i, from_hexfile, line);
 
-	for (int i = 1; getline(to_hexfile_f, line); i++)
-		parse_hexfile_line(to_hexfile_n, i, to_hexfile, line);
+	// -------------------------------------------------------
+	// Load from_hexfile and to_hexfiles
 
-	if (to_hexfile.size() > 0 && from_hexfile.size() > to_hexfile.size()) {
-		if (verbose)
-			fprintf(stderr, "Padding to_hexfile from %d words to %d\n",
-				int(to_hexfile.size()), int(from_hexfile.size()));
-		do
-			to_hexfile.push_back(vector<bool>(to_hexfile.at(0).size()));
-		while (from_hexfile.size() > to_hexfile.size());
-	}
+	const char *from_hexfile_n = argv[optind];
+	hexfile_t from_hexfile;
+	load_hexfile(from_hexfile_n, from_hexfile, false);
 
-	if (from_hexfile.size() != to_hexfile.size()) {
-		fprintf(stderr, "Hexfiles have different number of words! (%d vs. %d)\n", int(from_hexfile.size()), int(to_hexfile.size()));
+	if (from_hexfile.depth % 256 != 0) {
+		fprintf(stderr, "Hexfile number of words (%d) is not divisible by 256!\n", from_hexfile.depth);
 		exit(1);
 	}
 
-	if (from_hexfile.size() % 256 != 0) {
-		fprintf(stderr, "Hexfile number of words (%d) is not divisible by 256!\n", int(from_hexfile.size()));
+	if (from_hexfile.depth == 0) {
+		fprintf(stderr, "Empty from/to hexfiles!\n");
 		exit(1);
 	}
 
-	for (size_t i = 1; i < from_hexfile.size(); i++)
-		if (from_hexfile.at(i-1).size() != from_hexfile.at(i).size()) {
-			fprintf(stderr, "Inconsistent word width at line %d of %s!\n", int(i), from_hexfile_n);
-			exit(1);
+	if (verbose)
+		fprintf(stderr, "Loaded pattern for %d bits wide and %d words deep memory.\n", from_hexfile.width, from_hexfile.depth);
+
+	vector<bitslice_t> from_slices;
+	make_slices(from_hexfile, from_slices);
+
+	vector<vector<bitslice_t>> to_slices(num_outputs);
+
+	parallel_for(num_outputs, num_threads, [&](int v)
+	{
+		const char *to_hexfile_n = argv[optind+1+v];
+		hexfile_t to_hexfile;
+		load_hexfile(to_hexfile_n, to_hexfile, true);
+
+		if (to_hexfile.depth > 0 && from_hexfile.depth > to_hexfile.depth) {
+			if (verbose)
+				fprintf(stderr, "Padding %s from %d words to %d\n", to_hexfile_n,
+					to_hexfile.depth, from_hexfile.depth);
+			to_hexfile.data.resize(size_t(from_hexfile.depth) * to_hexfile.stride);
+			to_hexfile.depth = from_hexfile.depth;
 		}
 
-	for (size_t i = 1; i < to_hexfile.size(); i++) {
-		while (to_hexfile.at(i-1).size() > to_hexfile.at(i).size())
-			to_hexfile.at(i).push_back(false);
-		if (to_hexfile.at(i-1).size() != to_hexfile.at(i).size()) {
-			fprintf(stderr, "Inconsistent word width at line %d of %s!\n", int(i+1), to_hexfile_n);
+		if (from_hexfile.depth != to_hexfile.depth) {
+			fprintf(stderr, "Hexfiles have different number of words! (%d vs. %d)\n", from_hexfile.depth, to_hexfile.depth);
 			exit(1);
 		}
-	}
 
-	if (from_hexfile.size() == 0 || from_hexfile.at(0).size() == 0) {
-		fprintf(stderr, "Empty from/to hexfiles!\n");
-		exit(1);
-	}
+		if (to_hexfile.width != from_hexfile.width) {
+			fprintf(stderr, "Hexfiles have different word width! (%d vs. %d)\n", from_hexfile.width, to_hexfile.width);
+			exit(1);
+		}
 
-	if (verbose)
-		fprintf(stderr, "Loaded pattern for %d bits wide and %d words deep memory.\n", int(from_hexfile.at(0).size()), int(from_hexfile.size()));
+		make_slices(to_hexfile, to_slices[v]);
+	});
 
 
 	// -------------------------------------------------------
-	// Create bitslices from pattern data
-
-	map<vector<bool>, pair<vector<bool>, int>> pattern;
+	// Create bitslice index from pattern data
 
-	for (int i = 0; i < int(from_hexfile.at(0).size()); i++)
-	{
-		vector<bool> pattern_from, pattern_to;
-
-		for (int j = 0; j < int(from_hexfile.size()); j++)
-		{
-			pattern_from.push_back(from_hexfile.at(j).at(i));
-			pattern_to.push_back(to_hexfile.at(j).at(i));
+	int num_blocks = from_hexfile.depth / 256;
+	slice_table_t pattern;
+	pattern.reserve(from_slices.size());
 
-			if (pattern_from.size() == 256) {
-				if (pattern.count(pattern_from)) {
-					fprintf(stderr, "Conflicting from pattern for bit slice from_hexfile[%d:%d][%d]!\n", j, j-255, i);
-					exit(1);
-				}
-				pattern[pattern_from] = std::make_pair(pattern_to, 0);
-				pattern_from.clear(), pattern_to.clear();
-			}
+	for (int n = 0; n < int(from_slices.size()); n++)
+		if (!pattern.insert(from_slices[n], n)) {
+			int b = n % num_blocks, i = n / num_blocks;
+			fprintf(stderr, "Conflicting from pattern for bit slice from_hexfile[%d:%d][%d]!\n", 256*b+255, 256*b, i);
+			exit(1);
 		}
 
-		assert(pattern_from.empty());
-		assert(pattern_to.empty());
-	}
-
 	if (verbose)
-		fprintf(stderr, "Extracted %d bit slices from from/to hexfile data.\n", int(pattern.size()));
+		fprintf(stderr, "Extracted %d bit slices from from/to hexfile data.\n", pattern.size);
 
 
 	// -------------------------------------------------------
-	// Read ascfile from stdin
+	// Open outputs
 
-	vector<string> ascfile_lines;
-	map<string, vector<vector<bool>>> ascfile_hexdata;
+	vector<FILE*> outputs;
 
-	for (int i = 1; getline(std::cin, line); i++)
-	{
-	next_asc_stmt:
-		ascfile_lines.push_back(line);
-
-		if (line.substr(0, 9) == ".ram_data")
-		{
-			auto &hexdata = ascfile_hexdata[line];
-
-			for (; getline(std::cin, line); i++) {
-				if (line.substr(0, 1) == ".")
-					goto next_asc_stmt;
-				parse_hexfile_line("stdin", i, hexdata, line);
-			}
+	for (int v = 0; v < num_outputs; v++) {
+		if (output_template.empty()) {
+			outputs.push_back(stdout);
+			continue;
+		}
+		FILE *f = fopen(output_names[v].c_str(), "wb");
+		if (f == nullptr) {
+			perror("Can't open output file");
+			fprintf(stderr, "  %s\n", output_names[v].c_str());
+			exit(1);
 		}
+		outputs.push_back(f);
 	}
 
-	if (verbose)
-		fprintf(stderr, "Found %d initialized bram cells in asc file.\n", int(ascfile_hexdata.size()));
-
 
 	// -------------------------------------------------------
-	// Replace bram data
+	// Read ascfile or bitstream from stdin and match bitslices
 
 	int max_replace_cnt = 0;
 
-	for (auto &bram_it : ascfile_hexdata)
-	{
-		auto &bram_data = bram_it.second;
+	vector<uint8_t> bitstream;
+	bitstream_layout_t bitstream_layout;
 
-		for (int i = 0; i < 16; i++)
-		{
-			vector<bool> from_bitslice;
+	vector<string> ascfile_lines;
+	map<string, bram_data_t> ascfile_hexdata;
+
+	vector<bram_match_t> bram_matches;
+	map<string, bram_match_t> ascfile_matches;
+
+	if (stream) {
+		int ch = getc(stdin);
+		ungetc(ch, stdin);
+		if (ch != EOF && (ch == 0xff || ch == 0x7e)) {
+			if (verbose)
+				fprintf(stderr, "Input is a bitstream, streaming mode disabled.\n");
+			stream = false;
+		}
+	}
 
-			for (int j = 0; j < 256; j++)
-				from_bitslice.push_back(bram_data.at(j / 16).at(16 * (j % 16) + i));
+	if (stream)
+	{
+		AscRamStreamer streamer(pattern, to_slices, outputs, max_replace_cnt);
 
-			auto p = pattern.find(from_bitslice);
-			if (p != pattern.end())
-			{
-				auto &to_bitslice = p->second.first;
+		if (!asc_parse_stream(stdin, streamer)) {
+			perror("Can't read input from stdin");
+			exit(1);
+		}
+		streamer.end_bram(-1);
 
-				for (int j = 0; j < 256; j++)
-					bram_data.at(j / 16).at(16 * (j % 16) + i) = to_bitslice.at(j);
+		if (verbose)
+			fprintf(stderr, "Found %d initialized bram cells in asc file.\n", streamer.num_brams);
+	}
+	else
+	{
+		AscFile ascfile;
+		if (!ascfile.open("-")) {
+			perror("Can't read input from stdin");
+			exit(1);
+		}
 
-				max_replace_cnt = std::max(++p->second.second, max_replace_cnt);
+		if (is_bitstream(ascfile.data, ascfile.size))
+		{
+			bitstream.assign(ascfile.data, ascfile.data + ascfile.size);
+			parse_bitstream(bitstream, bitstream_layout);
+
+			if (verbose)
+				fprintf(stderr, "Found %d bram cells in bitstream.\n", int(bitstream_layout.bram_words.size()));
+
+			// a bitstream contains all bram cells, skip the empty ones like they
+			// are missing in the .asc file, otherwise bitslices that are all zero
+			// would match every unused bram cell
+			bram_matches.resize(bitstream_layout.bram_words.size());
+			for (int n = 0; n < int(bram_matches.size()); n++) {
+				uint16_t words[256];
+				bitstream_layout.read_words(bitstream, n, words);
+				if (std::all_of(words, words + 256, [](uint16_t w) { return w == 0; }))
+					continue;
+				match_bram_data(pattern, words, bram_matches[n], max_replace_cnt);
 			}
 		}
+		else
+		{
+			AscRamReader reader(ascfile_lines, ascfile_hexdata);
+			ascfile.parse(reader);
+
+			for (auto &bram_it : ascfile_hexdata)
+				if (bram_it.second.lines != 16) {
+					fprintf(stderr, "Incomplete BRAM data for %s!\n", bram_it.first.c_str());
+					exit(1);
+				}
+
+			if (verbose)
+				fprintf(stderr, "Found %d initialized bram cells in asc file.\n", int(ascfile_hexdata.size()));
+
+			for (auto &bram_it : ascfile_hexdata)
+				match_bram_data(pattern, bram_it.second.words, ascfile_matches[bram_it.first], max_replace_cnt);
+		}
 	}
 
 	int min_replace_cnt = max_replace_cnt;
-	for (auto &it : pattern)
-		min_replace_cnt = std::min(min_replace_cnt, it.second.second);
+	for (auto &it : pattern.entries)
+		if (it.used)
+			min_replace_cnt = std::min(min_replace_cnt, it.count);
 
 	if (min_replace_cnt != max_replace_cnt) {
 		fprintf(stderr, "Found some bitslices up to %d times, others only %d times!\n", max_replace_cnt, min_replace_cnt);
@@ -376,21 +1092,51 @@ int main(int argc, char **argv)
 
 
 	// -------------------------------------------------------
-	// Write ascfile to stdout
-
-	for (size_t i = 0; i < ascfile_lines.size(); i++) {
-		auto &line = ascfile_lines.at(i);
-		std::cout << line << std::endl;
-		if (ascfile_hexdata.count(line)) {
-			for (auto &word : ascfile_hexdata.at(line)) {
-				for (int k = word.size()-4; k >= 0; k -= 4) {
-					int digit = (word[k+3] ? 8 : 0) + (word[k+2] ? 4 : 0) + (word[k+1] ? 2 : 0) + (word[k] ? 1 : 0);
-					std::cout << "0123456789abcdef"[digit];
+	// Write ascfiles or bitstreams
+
+	parallel_for(stream ? 0 : num_outputs, num_threads, [&](int v)
+	{
+		FILE *f = outputs[v];
+
+		if (!bitstream.empty())
+		{
+			vector<uint8_t> bin = bitstream;
+			bool changed = false;
+
+			for (int n = 0; n < int(bram_matches.size()); n++) {
+				uint16_t words[256];
+				if (apply_bram_match(bram_matches[n], to_slices[v], words)) {
+					bitstream_layout.write_words(bin, n, words);
+					changed = true;
 				}
-				std::cout << std::endl;
 			}
+
+			if (changed)
+				bitstream_layout.update_crc(bin);
+
+			fwrite(bin.data(), 1, bin.size(), f);
+		}
+		else
+		{
+			for (auto &line : ascfile_lines) {
+				fprintf(f, "%s\n", line.c_str());
+				auto it = ascfile_hexdata.find(line);
+				if (it != ascfile_hexdata.end()) {
+					uint16_t words[256];
+					std::copy_n(it->second.words, 256, words);
+					apply_bram_match(ascfile_matches.at(line), to_slices[v], words);
+					write_bram_data(f, words);
+				}
+			}
+		}
+	});
+
+	for (int v = 0; v < num_outputs; v++)
+		if (fflush(outputs[v]) != 0 || ferror(outputs[v]) || (outputs[v] != stdout && fclose(outputs[v]) != 0)) {
+			perror("Can't write output file");
+			fprintf(stderr, "  %s\n", output_names[v].c_str());
+			exit(1);
 		}
-	}
 
 	return 0;
 }
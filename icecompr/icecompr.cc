@@ -10,197 +10,235 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include <vector>
-#include <map>
+
+#include "icecompr.h"
 
 int verbose = 0;
 
-static void push_int_bits(std::vector<bool> &outbits, int value, int bits)
+// Benchmark mode (-B): compress and decompress every file (all *.bin files
+// for directories) with each format, check the round trip and write sizes,
+// throughput and opcode statistics as JSON to stdout.
+
+static void collect_files(std::vector<std::string> &files, const char *path)
 {
-	while (bits-- > 0)
-		outbits.push_back((value >> bits) & 1);
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		files.push_back(path);
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	if (dir == nullptr) {
+		fprintf(stderr, "Failed to open directory `%s': %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	std::vector<std::string> names;
+	while (struct dirent *ent = readdir(dir)) {
+		std::string name = ent->d_name;
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0)
+			names.push_back(std::string(path) + "/" + name);
+	}
+	closedir(dir);
+
+	std::sort(names.begin(), names.end());
+	files.insert(files.end(), names.begin(), names.end());
 }
 
-static void push_zero_bits(std::vector<bool> &outbits, int bits)
+static std::string json_string(const std::string &str)
 {
-	while (bits-- > 0)
-		outbits.push_back(false);
+	std::string ret = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			ret += '\\', ret += c;
+		else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			ret += buf;
+		} else
+			ret += c;
+	}
+	return ret + "\"";
 }
 
-static int decode_int_from_bits(const std::vector<bool> &inbits, int &cursor, int bits)
+// Run fn repeatedly for at least 100 ms, returns the time per run in seconds
+template<typename F>
+static double time_per_run(F fn)
 {
-	int ret = 0;
-	while (bits-- > 0)
-		if (inbits.at(cursor++))
-			ret |= 1 << bits;
-	return ret;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed;
+	int runs = 0;
+	do {
+		fn();
+		runs++;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < 0.1);
+	return elapsed / runs;
 }
 
-void ice_compress(std::vector<bool> &outbits, const std::vector<bool> &inbits)
+static int benchmark(const char *format, int argc, char **argv)
 {
-	int opcode_stats_d4 = 0;
-	int opcode_stats_d32 = 0;
-	int opcode_stats_d256 = 0;
-	int opcode_stats_raw = 0;
-	int opcode_stats_d8M = 0;
-	int opcode_stats_end = 0;
+	std::vector<std::string> files;
+	for (int i = 0; i < argc; i++)
+		collect_files(files, argv[i]);
 
-	std::vector<int> deltas;
-	int numzeros = 0;
+	struct total_t {
+		int files = 0;
+		double size = 0, compressed_size = 0, compress_time = 0, decompress_time = 0;
+	};
+	std::vector<total_t> totals(sizeof(backends) / sizeof(*backends));
+	bool all_ok = true;
 
-	for (auto bit : inbits)
+	printf("{\n  \"files\": [");
+
+	for (size_t file_idx = 0; file_idx < files.size(); file_idx++)
 	{
-		if (bit) {
-			deltas.push_back(numzeros);
-			numzeros = 0;
-		} else {
-			numzeros++;
+		FILE *f = fopen(files[file_idx].c_str(), "rb");
+		if (f == nullptr) {
+			fprintf(stderr, "Failed to open input file `%s': %s\n", files[file_idx].c_str(), strerror(errno));
+			return 1;
 		}
-	}
 
-	for (int i = 0; i < int(deltas.size()); i++)
-	{
-		int raw_len = 0;
-		int compr_len = 0;
-		int best_compr_raw_diff = -1;
-		int best_compr_raw_idx = -1;
-		int best_compr_raw_len = -1;
+		std::vector<uint8_t> original_bytes;
+		uint8_t buffer[65536];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			original_bytes.insert(original_bytes.end(), buffer, buffer + n);
+		fclose(f);
 
-		for (int j = 0; j+i < int(deltas.size()); j++)
-		{
-			int delta = deltas.at(i + j);
-			raw_len += delta + 1;
-
-			if (delta < 4)
-				compr_len += 3;
-			else if (delta < 32)
-				compr_len += 7;
-			else if (delta < 256)
-				compr_len += 11;
-			else
-				compr_len += 26;
-
-			if (compr_len - raw_len < std::max(best_compr_raw_diff - 4, 0) || raw_len > 64)
-				break;
-
-			if (compr_len - raw_len > best_compr_raw_diff) {
-				best_compr_raw_diff = compr_len - raw_len;
-				best_compr_raw_idx = j;
-				best_compr_raw_len = raw_len;
-			}
-		}
+		BitBuffer original_bits;
+		original_bits.from_bytes(original_bytes);
 
-		if (best_compr_raw_diff > 9)
-		{
-			opcode_stats_raw++;
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(true);
-			push_int_bits(outbits, best_compr_raw_len-1, 6);
-
-			for (int j = 0; j <= best_compr_raw_idx; j++) {
-				int delta = deltas.at(i + j);
-				for (int k = 0; k < delta; k++)
-					outbits.push_back(false);
-				if (j < best_compr_raw_idx)
-					outbits.push_back(true);
-			}
+		if (verbose > 0)
+			fprintf(stderr, "Benchmarking %s..\n", files[file_idx].c_str());
 
-			i += best_compr_raw_idx;
-			continue;
-		}
+		printf("%s\n    {\n", file_idx ? "," : "");
+		printf("      \"file\": %s,\n", json_string(files[file_idx]).c_str());
+		printf("      \"size\": %d,\n", int(original_bytes.size()));
+		printf("      \"formats\": {");
 
-		int delta = deltas.at(i);
+		const char *best_format = nullptr;
+		size_t best_size = 0;
+		bool first_format = true;
 
-		if (delta < 4) {
-			opcode_stats_d4++;
-			outbits.push_back(true);
-			push_int_bits(outbits, delta, 2);
-		} else
-		if (delta < 32) {
-			opcode_stats_d32++;
-			outbits.push_back(false);
-			outbits.push_back(true);
-			push_int_bits(outbits, delta, 5);
-		} else
-		if (delta < 256) {
-			opcode_stats_d256++;
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(true);
-			push_int_bits(outbits, delta, 8);
-		} else {
-			opcode_stats_d8M++;
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(false);
-			outbits.push_back(true);
-			push_int_bits(outbits, delta, 23);
+		for (size_t idx = 0; idx < totals.size(); idx++)
+		{
+			const backend_t &backend = backends[idx];
+			if (strcmp(format, "auto") && strcmp(format, backend.name))
+				continue;
+
+			std::vector<uint8_t> compressed_bytes, uncompressed_bytes;
+			OpcodeStats stats;
+			bool applicable = true;
+
+			double compress_time = time_per_run([&]() {
+				compressed_bytes.clear();
+				stats = OpcodeStats();
+				applicable = backend.compress(compressed_bytes, original_bytes, original_bits, stats);
+			});
+
+			if (!applicable)
+				continue;
+
+			bool roundtrip_ok = true;
+			double decompress_time = time_per_run([&]() {
+				uncompressed_bytes.clear();
+				roundtrip_ok = ice_uncompress(uncompressed_bytes, compressed_bytes) &&
+						uncompressed_bytes == original_bytes;
+			});
+
+			if (!roundtrip_ok) {
+				fprintf(stderr, "Round trip failed for %s with format %s.\n", files[file_idx].c_str(), backend.name);
+				all_ok = false;
+			}
+
+			if (best_format == nullptr || compressed_bytes.size() < best_size)
+				best_format = backend.name, best_size = compressed_bytes.size();
+
+			total_t &total = totals[idx];
+			total.files++;
+			total.size += original_bytes.size();
+			total.compressed_size += compressed_bytes.size();
+			total.compress_time += compress_time;
+			total.decompress_time += decompress_time;
+
+			printf("%s\n        \"%s\": {\n", first_format ? "" : ",", backend.name);
+			printf("          \"size\": %d,\n", int(compressed_bytes.size()));
+			printf("          \"ratio\": %.4f,\n", double(compressed_bytes.size()) / std::max<size_t>(original_bytes.size(), 1));
+			printf("          \"compress_mb_s\": %.2f,\n", 1e-6 * original_bytes.size() / compress_time);
+			printf("          \"decompress_mb_s\": %.2f,\n", 1e-6 * original_bytes.size() / decompress_time);
+			printf("          \"roundtrip_ok\": %s,\n", roundtrip_ok ? "true" : "false");
+			printf("          \"opcodes\": {");
+			for (size_t i = 0; i < stats.counts.size(); i++)
+				printf("%s \"%s\": %d", i ? "," : "", stats.counts[i].first, stats.counts[i].second);
+			printf(" }\n        }");
+			first_format = false;
 		}
-	}
 
-	opcode_stats_end++;
-	outbits.push_back(false);
-	outbits.push_back(false);
-	outbits.push_back(false);
-	outbits.push_back(false);
-	outbits.push_back(false);
-	push_int_bits(outbits, numzeros, 23);
-
-	if (verbose > 1) {
-		fprintf(stderr, "opcode d4   %5d\n", opcode_stats_d4);
-		fprintf(stderr, "opcode d32  %5d\n", opcode_stats_d32);
-		fprintf(stderr, "opcode d256 %5d\n", opcode_stats_d256);
-		fprintf(stderr, "opcode raw  %5d\n", opcode_stats_raw);
-		fprintf(stderr, "opcode d8M  %5d\n", opcode_stats_d8M);
-		fprintf(stderr, "opcode end  %5d\n", opcode_stats_end);
+		printf("\n      },\n");
+		printf("      \"best\": %s\n", best_format ? json_string(best_format).c_str() : "null");
+		printf("    }");
+		fflush(stdout);
 	}
-}
 
-void ice_uncompress(std::vector<bool> &outbits, const std::vector<bool> &inbits)
-{
-	int cursor = 0;
+	printf("\n  ],\n  \"total\": {");
 
-	while (cursor < int(inbits.size()))
+	bool first_format = true;
+	for (size_t idx = 0; idx < totals.size(); idx++)
 	{
-		if (inbits.at(cursor++)) {
-			int zeros = decode_int_from_bits(inbits, cursor, 2);
-			push_zero_bits(outbits, zeros);
-			outbits.push_back(true);
-		} else
-		if (inbits.at(cursor++)) {
-			int zeros = decode_int_from_bits(inbits, cursor, 5);
-			push_zero_bits(outbits, zeros);
-			outbits.push_back(true);
-		} else
-		if (inbits.at(cursor++)) {
-			int zeros = decode_int_from_bits(inbits, cursor, 8);
-			push_zero_bits(outbits, zeros);
-			outbits.push_back(true);
-		} else
-		if (inbits.at(cursor++)) {
-			int raw_len = decode_int_from_bits(inbits, cursor, 6);
-			while (raw_len--)
-				outbits.push_back(inbits.at(cursor++));
-			outbits.push_back(true);
-		} else
-		if (inbits.at(cursor++)) {
-			int zeros = decode_int_from_bits(inbits, cursor, 23);
-			push_zero_bits(outbits, zeros);
-			outbits.push_back(true);
-		} else {
-			int zeros = decode_int_from_bits(inbits, cursor, 23);
-			push_zero_bits(outbits, zeros);
-		}
+		const total_t &total = totals[idx];
+		if (total.files == 0)
+			continue;
+
+		printf("%s\n    \"%s\": {\n", first_format ? "" : ",", backends[idx].name);
+		printf("      \"files\": %d,\n", total.files);
+		printf("      \"size\": %.0f,\n", total.size);
+		printf("      \"compressed_size\": %.0f,\n", total.compressed_size);
+		printf("      \"ratio\": %.4f,\n", total.compressed_size / std::max(total.size, 1.0));
+		printf("      \"compress_mb_s\": %.2f,\n", 1e-6 * total.size / total.compress_time);
+		printf("      \"decompress_mb_s\": %.2f\n", 1e-6 * total.size / total.decompress_time);
+		printf("    }");
+		first_format = false;
 	}
+
+	printf("\n  }\n}\n");
+
+	return all_ok ? 0 : 1;
 }
 
 void help()
 {
 	printf("\n");
-	printf("Usage: icecompr [-v] [input-file [output-file]]\n");
+	printf("Usage: icecompr [-v] [-m <format>] [input-file [output-file]]\n");
+	printf("       icecompr -B [-v] [-m <format>] {file-or-directory}\n");
+	printf("\n");
+	printf("    -m rle\n");
+	printf("        classic format, understood by all decoders (default)\n");
+	printf("\n");
+	printf("    -m tile\n");
+	printf("        classic format plus copies of repeated CRAM rows\n");
+	printf("\n");
+	printf("    -m lz\n");
+	printf("        LZ77 on bytes, for images with repetitive BRAM contents\n");
+	printf("\n");
+	printf("    -m auto\n");
+	printf("        try all formats and use the smallest result\n");
+	printf("\n");
+	printf("    -B\n");
+	printf("        benchmark mode: compress and decompress all given files (all\n");
+	printf("        *.bin files in directories) with all formats (or the one given\n");
+	printf("        with -m) and write ratio, throughput and opcode statistics as\n");
+	printf("        JSON to stdout\n");
+	printf("\n");
+	printf("    -v\n");
+	printf("        verbose output, repeat for opcode statistics\n");
 	printf("\n");
 	exit(1);
 }
@@ -210,11 +248,20 @@ int main(int argc, char **argv)
 	FILE *input_file = stdin;
 	FILE *output_file = stdout;
 
+	const char *format = nullptr;
+	bool benchmark_mode = false;
+
 	int opt;
-	while ((opt = getopt(argc, argv, "v")) != -1)
+	while ((opt = getopt(argc, argv, "m:vB")) != -1)
 	{
 		switch (opt)
 		{
+		case 'B':
+			benchmark_mode = true;
+			break;
+		case 'm':
+			format = optarg;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -223,6 +270,25 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (format != nullptr && strcmp(format, "auto")) {
+		bool found_format = false;
+		for (auto &backend : backends)
+			found_format |= !strcmp(format, backend.name);
+		if (!found_format) {
+			fprintf(stderr, "Unknown format `%s'.\n", format);
+			return 1;
+		}
+	}
+
+	if (benchmark_mode) {
+		if (optind == argc)
+			help();
+		return benchmark(format ? format : "auto", argc - optind, argv + optind);
+	}
+
+	if (format == nullptr)
+		format = "rle";
+
 	if (optind < argc) {
 		input_file = fopen(argv[optind], "rb");
 		if (input_file == NULL) {
@@ -244,45 +310,70 @@ int main(int argc, char **argv)
 	if (optind != argc)
 		help();
 
-	std::vector<bool> original_bits;
-	int count_set_bits = 0;
+	std::vector<uint8_t> original_bytes;
+	uint8_t buffer[65536];
+	size_t n;
 
-	while (1)
-	{
-		int byte = fgetc(input_file);
+	while ((n = fread(buffer, 1, sizeof(buffer), input_file)) > 0)
+		original_bytes.insert(original_bytes.end(), buffer, buffer + n);
 
-		if (byte < 0)
-			break;
+	BitBuffer original_bits;
+	original_bits.from_bytes(original_bytes);
 
-		// MSB first
-		for (int i = 7; i >= 0; i--) {
-			bool bit = (byte >> i) & 1;
-			if (bit) count_set_bits++;
-			original_bits.push_back(bit);
-		}
-	}
+	int count_set_bits = 0;
+	for (auto w : original_bits.words)
+		count_set_bits += __builtin_popcountll(w);
 
-	int uncompressed_size = original_bits.size();
+	int uncompressed_size = original_bits.nbits;
 
 	if (verbose > 0) {
 		fprintf(stderr, "Percentage of set bits: %.2f%%\n", (100.0*count_set_bits) / uncompressed_size);
 		fprintf(stderr, "Uncompressed size: %8d bits\n", uncompressed_size);
 	}
 
-	std::vector<bool> compressed_bits;
-	ice_compress(compressed_bits, original_bits);
+	std::vector<uint8_t> compressed_bytes, uncompressed_bytes;
+	OpcodeStats compressed_stats;
+
+	for (auto &backend : backends)
+	{
+		if (strcmp(format, "auto") && strcmp(format, backend.name))
+			continue;
+
+		std::vector<uint8_t> bytes;
+		OpcodeStats stats;
+		if (!backend.compress(bytes, original_bytes, original_bits, stats)) {
+			if (verbose > 0)
+				fprintf(stderr, "Format %s not applicable.\n", backend.name);
+			continue;
+		}
+
+		if (verbose > 0)
+			fprintf(stderr, "Format %-4s size: %8d bits\n", backend.name, int(8 * bytes.size()));
+
+		if (compressed_bytes.empty() || bytes.size() < compressed_bytes.size()) {
+			compressed_bytes.swap(bytes);
+			compressed_stats = stats;
+		}
+	}
+
+	if (compressed_bytes.empty()) {
+		fprintf(stderr, "Format `%s' is not applicable to this input.\n", format);
+		return 1;
+	}
 
-	int compressed_size = compressed_bits.size();
+	int compressed_size = 8 * compressed_bytes.size();
 
 	if (verbose > 0) {
-		fprintf(stderr, "Compressed size:   %8d bits\n", compressed_size);
+		fprintf(stderr, "Compressed size:   %8d bits (%.8s)\n", compressed_size, (const char*)compressed_bytes.data());
 		fprintf(stderr, "Space savings: %.2f%%\n", 100 - (100.0*compressed_size) / uncompressed_size);
 	}
 
-	std::vector<bool> uncompressed_bits;
-	ice_uncompress(uncompressed_bits, compressed_bits);
+	if (verbose > 1)
+		for (auto &it : compressed_stats.counts)
+			fprintf(stderr, "opcode %-4s %5d\n", it.first, it.second);
 
-	bool check_ok = original_bits == uncompressed_bits;
+	bool check_ok = ice_uncompress(uncompressed_bytes, compressed_bytes) &&
+			original_bytes == uncompressed_bytes;
 
 	if (verbose > 0 || !check_ok) {
 		fprintf(stderr, "Integrity check: %s\n", check_ok ? "OK" : "ERROR");
@@ -290,15 +381,7 @@ int main(int argc, char **argv)
 			return 1;
 	}
 
-	fprintf(output_file, "ICECOMPR");
-	for (int i = 0; i < int(compressed_bits.size()); i += 8) {
-		int value = 0;
-		for (int j = 0; j < 8 && i+j < int(compressed_bits.size()); j++)
-			if (compressed_bits.at(i+j))
-				value |= 1 << (7-j);
-		fputc(value, output_file);
-	}
+	fwrite(compressed_bytes.data(), 1, compressed_bytes.size(), output_file);
 
 	return 0;
 }
-
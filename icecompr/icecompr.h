@@ -0,0 +1,444 @@
+//
+//  icecompr -- compressors for the ICECOMPR bitstream formats
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  Usage:
+//
+//	std::vector<uint8_t> compressed;
+//	if (!ice_compress_bytes(compressed, data, "rle"))   // or "tile", "lz"
+//		...
+//
+//  The formats are described in README, iceuncompr.h is the matching
+//  decoder.
+//
+
+#ifndef ICECOMPR_H
+#define ICECOMPR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "iceuncompr.h"
+
+// Number of opcodes (or tokens) of each kind emitted by a compressor, in
+// the order in which the kinds were first counted
+struct OpcodeStats
+{
+	std::vector<std::pair<const char*, int>> counts;
+
+	int &operator[](const char *name)
+	{
+		for (auto &it : counts)
+			if (!strcmp(it.first, name))
+				return it.second;
+		counts.push_back(std::make_pair(name, 0));
+		return counts.back().second;
+	}
+};
+
+// Bit vector packed into 64 bit words, MSB first: bit n is bit 63-n%64 of
+// words[n/64]. This matches the bit order of the bitstream files.
+struct BitBuffer
+{
+	std::vector<uint64_t> words;
+	uint64_t nbits = 0;
+
+	// bits pos .. pos+63, MSB aligned, zero beyond the end
+	uint64_t peek(uint64_t pos) const
+	{
+		uint64_t idx = pos / 64, off = pos % 64;
+		uint64_t value = idx < words.size() ? words[idx] << off : 0;
+		if (off && idx+1 < words.size())
+			value |= words[idx+1] >> (64 - off);
+		return value;
+	}
+
+	// append the low bits of value, MSB first (bits <= 64)
+	void push(uint64_t value, int bits)
+	{
+		if (bits == 0)
+			return;
+		if (bits < 64)
+			value &= (uint64_t(1) << bits) - 1;
+
+		uint64_t off = nbits % 64;
+		if (off == 0)
+			words.push_back(0);
+		if (off + bits <= 64) {
+			words.back() |= value << (64 - off - bits);
+		} else {
+			words.back() |= value >> (off + bits - 64);
+			words.push_back(value << (128 - off - bits));
+		}
+		nbits += bits;
+	}
+
+	void from_bytes(const std::vector<uint8_t> &bytes)
+	{
+		words.assign((bytes.size() + 7) / 8, 0);
+		for (size_t i = 0; i < bytes.size(); i++)
+			words[i / 8] |= uint64_t(bytes[i]) << (56 - 8 * (i % 8));
+		nbits = 8 * bytes.size();
+	}
+
+	// append as bytes, zero padded to a multiple of 8 bits
+	void to_bytes(std::vector<uint8_t> &bytes) const
+	{
+		for (uint64_t i = 0; i < (nbits + 7) / 8; i++)
+			bytes.push_back(words[i / 8] >> (56 - 8 * (i % 8)));
+	}
+};
+
+// Number of equal bits at pos and pos-distance, at most max_len
+inline uint64_t match_len(const BitBuffer &bits, uint64_t pos, uint64_t distance, uint64_t max_len)
+{
+	uint64_t len = 0;
+	while (len < max_len) {
+		uint64_t diff = bits.peek(pos + len) ^ bits.peek(pos - distance + len);
+		if (diff != 0)
+			return std::min(len + __builtin_clzll(diff), max_len);
+		len += 64;
+	}
+	return max_len;
+}
+
+inline int delta_cost(int delta)
+{
+	if (delta < 4)
+		return 3;
+	if (delta < 32)
+		return 7;
+	if (delta < 256)
+		return 11;
+	return 26;
+}
+
+// The classic format (row_width == 0) and the "tile" format, which adds an
+// opcode for copying bits from 1..16 CRAM rows back.
+inline void ice_compress(BitBuffer &outbits, const BitBuffer &inbits, int row_width, OpcodeStats &stats)
+{
+	for (auto name : { "d4", "d32", "d256", "raw", "d8M", "end" })
+		stats[name] = 0;
+	if (row_width > 0)
+		stats["copy"] = 0;
+
+	// positions of all ONE bits and the lengths of the ZERO runs before them
+	std::vector<uint64_t> ones;
+	std::vector<int> deltas;
+	int64_t last_one = -1;
+
+	for (size_t i = 0; i < inbits.words.size(); i++)
+		for (uint64_t w = inbits.words[i]; w != 0; w &= ~(uint64_t(1) << 63 >> __builtin_clzll(w))) {
+			int64_t pos = 64 * i + __builtin_clzll(w);
+			ones.push_back(pos);
+			deltas.push_back(pos - last_one - 1);
+			last_one = pos;
+		}
+
+	// next output bit
+	uint64_t cursor = 0;
+
+	for (int i = 0; i < int(deltas.size()); i++)
+	{
+		if (row_width > 0)
+		{
+			uint64_t best_len = 0;
+			int best_rows = 0;
+
+			for (int rows = 1; rows <= 16; rows++) {
+				if (cursor < uint64_t(rows * row_width))
+					break;
+				uint64_t len = match_len(inbits, cursor, rows * row_width, std::min<uint64_t>(0xffff, inbits.nbits - cursor));
+				if (len > best_len)
+					best_len = len, best_rows = rows;
+			}
+
+			// estimated savings: the opcodes for all ONE bits covered by
+			// the copy, and a shorter ZERO run before the next ONE bit
+			uint64_t end = cursor + best_len;
+			int j = i, saved = 0;
+			for (; j < int(ones.size()) && ones[j] < end; j++)
+				saved += delta_cost(deltas[j]);
+			if (j < int(ones.size()))
+				saved += delta_cost(deltas[j]) - delta_cost(ones[j] - end);
+
+			if (saved > 26)
+			{
+				stats["copy"]++;
+				outbits.push(0x1, 5);
+				outbits.push(1, 1);
+				outbits.push(best_rows - 1, 4);
+				outbits.push(best_len, 16);
+
+				cursor = end;
+				if (j < int(ones.size()))
+					deltas[j] = ones[j] - end;
+				i = j - 1;
+				continue;
+			}
+		}
+
+		int raw_len = 0;
+		int compr_len = 0;
+		int best_compr_raw_diff = -1;
+		int best_compr_raw_idx = -1;
+		int best_compr_raw_len = -1;
+
+		// bounded lookahead: a raw opcode covers at most 64 bits, so this
+		// loop runs at most 64 times per opcode
+		for (int j = 0; j+i < int(deltas.size()); j++)
+		{
+			int delta = deltas[i + j];
+			raw_len += delta + 1;
+
+			if (delta < 4)
+				compr_len += 3;
+			else if (delta < 32)
+				compr_len += 7;
+			else if (delta < 256)
+				compr_len += 11;
+			else
+				compr_len += 26;
+
+			if (compr_len - raw_len < std::max(best_compr_raw_diff - 4, 0) || raw_len > 64)
+				break;
+
+			if (compr_len - raw_len > best_compr_raw_diff) {
+				best_compr_raw_diff = compr_len - raw_len;
+				best_compr_raw_idx = j;
+				best_compr_raw_len = raw_len;
+			}
+		}
+
+		if (best_compr_raw_diff > 9)
+		{
+			// data bits: everything from the first ZERO of delta i up to
+			// (excluding) the last ONE of the raw block
+			int data_len = best_compr_raw_len - 1;
+			uint64_t start = ones[i] - deltas[i];
+
+			stats["raw"]++;
+			outbits.push(0x1, 4);
+			outbits.push(data_len, 6);
+			outbits.push(inbits.peek(start) >> (64 - data_len), data_len);
+
+			i += best_compr_raw_idx;
+			cursor = ones[i] + 1;
+			continue;
+		}
+
+		int delta = deltas[i];
+		cursor = ones[i] + 1;
+
+		if (delta < 4) {
+			stats["d4"]++;
+			outbits.push(0x4 | delta, 3);
+		} else
+		if (delta < 32) {
+			stats["d32"]++;
+			outbits.push(0x20 | delta, 7);
+		} else
+		if (delta < 256) {
+			stats["d256"]++;
+			outbits.push(0x100 | delta, 11);
+		} else {
+			stats["d8M"]++;
+			outbits.push(0x1, 5);
+			if (row_width > 0)
+				outbits.push(0, 1);
+			outbits.push(delta, 23);
+		}
+	}
+
+	stats["end"]++;
+	outbits.push(0x0, 5);
+	outbits.push(inbits.nbits - cursor, 23);
+}
+
+// The "lz" format: LZ77 on bytes, see iceuncompr.h for the token format
+inline void lz_compress(std::vector<uint8_t> &out, const std::vector<uint8_t> &in, OpcodeStats &stats)
+{
+	for (auto name : { "literal", "literal_bytes", "copy", "copy_bytes", "end" })
+		stats[name] = 0;
+
+	const int min_len = 3, max_len = 129, max_chain = 64;
+	const int size = in.size();
+
+	std::vector<int> head(1 << 16, -1), prev(size, -1);
+
+	auto insert = [&](int i) {
+		if (i + min_len > size)
+			return;
+		uint32_t h = ((in[i] << 16 | in[i+1] << 8 | in[i+2]) * 2654435761u) >> 16;
+		prev[i] = head[h];
+		head[h] = i;
+	};
+
+	int literals = 0;
+
+	auto flush_literals = [&](int end) {
+		while (literals < end) {
+			int n = std::min(end - literals, 128);
+			out.push_back(n - 1);
+			out.insert(out.end(), in.begin() + literals, in.begin() + literals + n);
+			stats["literal"]++;
+			stats["literal_bytes"] += n;
+			literals += n;
+		}
+	};
+
+	for (int i = 0; i < size;)
+	{
+		int best_len = 0, best_dist = 0;
+
+		if (i + min_len <= size) {
+			uint32_t h = ((in[i] << 16 | in[i+1] << 8 | in[i+2]) * 2654435761u) >> 16;
+			for (int j = head[h], chain = 0; j >= 0 && i - j <= ICE_UNCOMPR_WINDOW && chain < max_chain; j = prev[j], chain++) {
+				int len = 0;
+				while (len < max_len && i + len < size && in[j + len] == in[i + len])
+					len++;
+				if (len > best_len) {
+					best_len = len, best_dist = i - j;
+					if (len == max_len)
+						break;
+				}
+			}
+		}
+
+		if (best_len < min_len) {
+			insert(i++);
+			continue;
+		}
+
+		flush_literals(i);
+		out.push_back(0x80 | (best_len - 3));
+		out.push_back((best_dist - 1) >> 8);
+		out.push_back(best_dist - 1);
+		stats["copy"]++;
+		stats["copy_bytes"] += best_len;
+
+		while (best_len-- > 0)
+			insert(i++);
+		literals = i;
+	}
+
+	flush_literals(size);
+	out.push_back(0xff);
+	stats["end"]++;
+}
+
+// CRAM row width in bits from the first "bank width" command before the
+// CRAM data in a binary bitstream, 0 if there is none.
+inline int cram_row_width(const std::vector<uint8_t> &data)
+{
+	size_t i = 0, width = 0;
+
+	while (i + 4 <= data.size() && !(data[i] == 0x7e && data[i+1] == 0xaa && data[i+2] == 0x99 && data[i+3] == 0x7e))
+		i++;
+
+	for (i += 4; i < data.size();)
+	{
+		int cmd = data[i++], payload = 0;
+		for (int k = 0; k < (cmd & 15) && i < data.size(); k++)
+			payload = payload << 8 | data[i++];
+
+		if (cmd == 0x62)
+			width = payload + 1;
+		if (cmd == 0x01 && payload == 0x01)
+			return width;
+	}
+
+	return 0;
+}
+
+// Compression backends. Each one writes a complete .compr file, the last
+// byte of the "ICECOMP?" magic tells the decoder which format was used.
+struct backend_t
+{
+	const char *name;
+	bool (*compress)(std::vector<uint8_t> &out, const std::vector<uint8_t> &in, const BitBuffer &inbits, OpcodeStats &stats);
+};
+
+static const backend_t backends[] = {
+	{ "rle", [](std::vector<uint8_t> &out, const std::vector<uint8_t> &, const BitBuffer &inbits, OpcodeStats &stats) {
+		BitBuffer outbits;
+		ice_compress(outbits, inbits, 0, stats);
+		out.assign((const uint8_t*)"ICECOMPR", (const uint8_t*)"ICECOMPR" + 8);
+		outbits.to_bytes(out);
+		return true;
+	} },
+	{ "tile", [](std::vector<uint8_t> &out, const std::vector<uint8_t> &in, const BitBuffer &inbits, OpcodeStats &stats) {
+		int row_width = cram_row_width(in);
+		if (row_width < 8 || 16 * row_width > 8 * (ICE_UNCOMPR_WINDOW - 1))
+			return false;
+		BitBuffer outbits;
+		ice_compress(outbits, inbits, row_width, stats);
+		out.assign((const uint8_t*)"ICECOMPT", (const uint8_t*)"ICECOMPT" + 8);
+		out.push_back(row_width >> 8);
+		out.push_back(row_width);
+		outbits.to_bytes(out);
+		return true;
+	} },
+	{ "lz", [](std::vector<uint8_t> &out, const std::vector<uint8_t> &in, const BitBuffer &, OpcodeStats &stats) {
+		out.assign((const uint8_t*)"ICECOMPL", (const uint8_t*)"ICECOMPL" + 8);
+		lz_compress(out, in, stats);
+		return true;
+	} },
+};
+
+// Decode a complete .compr file (including the magic) with the streaming
+// decoder, feeding it in small chunks. Returns false on errors.
+inline bool ice_uncompress(std::vector<uint8_t> &outbytes, const std::vector<uint8_t> &inbytes)
+{
+	struct ice_uncompr s;
+	ice_uncompr_init(&s);
+
+	const uint8_t *in = inbytes.data();
+	size_t in_left = inbytes.size();
+
+	while (1)
+	{
+		uint8_t buffer[4096];
+		uint8_t *out = buffer;
+		size_t out_avail = sizeof(buffer);
+
+		size_t in_avail = std::min(in_left, sizeof(buffer));
+		in_left -= in_avail;
+
+		int rc = ice_uncompr_run(&s, &in, &in_avail, &out, &out_avail);
+		in_left += in_avail;
+		outbytes.insert(outbytes.end(), buffer, out);
+
+		if (rc != ICE_UNCOMPR_MORE)
+			return rc == ICE_UNCOMPR_DONE;
+		if (in_left == 0 && out_avail > 0)
+			return false;
+	}
+}
+
+// Compress data with the named backend. Returns false if the backend does
+// not exist or is not applicable to the data.
+inline bool ice_compress_bytes(std::vector<uint8_t> &out, const std::vector<uint8_t> &in, const char *format)
+{
+	for (auto &backend : backends) {
+		if (strcmp(backend.name, format))
+			continue;
+		BitBuffer inbits;
+		inbits.from_bytes(in);
+		OpcodeStats stats;
+		out.clear();
+		return backend.compress(out, in, inbits, stats);
+	}
+	return false;
+}
+
+#endif
@@ -5,107 +5,58 @@
 // binary, for any purpose, commercial or non-commercial, and by any
 // means.
 
+// for getopt()
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 
+#include "iceuncompr.h"
+
 FILE *input_file;
 FILE *output_file;
 
-int read_bitcounter;
-int read_buffer;
-
-int write_bitcounter;
-int write_buffer;
-
-static int read_bit()
-{
-	if (read_bitcounter == 0) {
-		read_bitcounter = 8;
-		read_buffer = fgetc(input_file);
-	}
-
-	read_bitcounter--;
-	return (read_buffer >> read_bitcounter) & 1;
-}
-
-static void write_bit(int value)
+int ice_uncompress()
 {
-	write_bitcounter--;
-
-	if (value)
-		write_buffer |= 1 << write_bitcounter;
-
-	if (write_bitcounter == 0) {
-		fputc(write_buffer, output_file);
-		write_bitcounter = 8;
-		write_buffer = 0;
-	}
-}
+	struct ice_uncompr s;
+	ice_uncompr_init(&s);
 
-static int read_int(int bits)
-{
-	int ret = 0;
-	while (bits-- > 0)
-		if (read_bit())
-			ret |= 1 << bits;
-	return ret;
-}
+	static uint8_t in_buffer[65536], out_buffer[65536];
+	const uint8_t *in = in_buffer;
+	size_t in_avail = 0;
+	int eof = 0;
 
-static void write_zeros(int bits)
-{
-	while (bits-- > 0)
-		write_bit(0);
-}
+	while (1)
+	{
+		if (in_avail == 0 && !eof) {
+			in = in_buffer;
+			in_avail = fread(in_buffer, 1, sizeof(in_buffer), input_file);
+			eof = in_avail == 0;
+		}
 
-int ice_uncompress()
-{
-	read_bitcounter = 0;
-	read_buffer = 0;
+		uint8_t *out = out_buffer;
+		size_t out_avail = sizeof(out_buffer);
+		int rc = ice_uncompr_run(&s, &in, &in_avail, &out, &out_avail);
 
-	write_bitcounter = 8;
-	write_buffer = 0;
+		fwrite(out_buffer, 1, out - out_buffer, output_file);
 
-	int magic1_ok = read_int(32) == 0x49434543;
-	int magic2_ok = read_int(32) == 0x4f4d5052;
+		if (rc == ICE_UNCOMPR_ERROR) {
+			fprintf(stderr, "Missing ICECOMPR magic or corrupt input. Abort!\n");
+			return 1;
+		}
 
-	if (!magic1_ok || !magic2_ok) {
-		fprintf(stderr, "Missing ICECOMPR magic. Abort!\n");
-		return 1;
-	}
+		if (rc == ICE_UNCOMPR_DONE)
+			return 0;
 
-	while (1)
-	{
-		if (read_bit()) {
-			write_zeros(read_int(2));
-			write_bit(1);
-		} else
-		if (read_bit()) {
-			write_zeros(read_int(5));
-			write_bit(1);
-		} else
-		if (read_bit()) {
-			write_zeros(read_int(8));
-			write_bit(1);
-		} else
-		if (read_bit()) {
-			int n = read_int(6);
-			while (n--)
-				write_bit(read_bit());
-			write_bit(1);
-		} else
-		if (read_bit()) {
-			write_zeros(read_int(23));
-			write_bit(1);
-		} else {
-			write_zeros(read_int(23));
-			break;
+		if (eof && in_avail == 0 && out_avail > 0) {
+			fprintf(stderr, "Unexpected end of input. Abort!\n");
+			return 1;
 		}
 	}
-
-	return 0;
 }
 
 void help()
@@ -0,0 +1,321 @@
+// This is free and unencumbered software released into the public domain.
+//
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+
+// Resumable decoder for the ICECOMPR formats (see README).
+//
+// The decoder is a state machine that consumes input and produces output in
+// chunks of arbitrary size, so a bitstream can be decompressed while it is
+// being received or sent to the FPGA without ever holding all of it in
+// memory. The state is a small plain struct without any allocations.
+//
+//	struct ice_uncompr s;
+//	ice_uncompr_init(&s);
+//
+//	while (1) {
+//		const uint8_t *in = ...; size_t in_avail = ...;   // next input chunk
+//		uint8_t *out = buffer; size_t out_avail = sizeof(buffer);
+//		int rc = ice_uncompr_run(&s, &in, &in_avail, &out, &out_avail);
+//		// use out - buffer bytes from buffer
+//		// rc == ICE_UNCOMPR_MORE: call again (with more input if in_avail == 0)
+//		// rc == ICE_UNCOMPR_DONE: end of the compressed data
+//		// rc == ICE_UNCOMPR_ERROR: missing ICECOMPR magic or corrupt data
+//	}
+//
+// Plain C99, usable from C and C++.
+
+#ifndef ICEUNCOMPR_H
+#define ICEUNCOMPR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Size of the output history kept for the "tile" and "lz" formats
+#define ICE_UNCOMPR_WINDOW 4096
+
+enum {
+	ICE_UNCOMPR_ERROR = -1,
+	ICE_UNCOMPR_MORE = 0,
+	ICE_UNCOMPR_DONE = 1
+};
+
+enum {
+	ICE_UNCOMPR_ST_MAGIC,
+	ICE_UNCOMPR_ST_ROW_WIDTH,
+	ICE_UNCOMPR_ST_OPCODE,
+	ICE_UNCOMPR_ST_ZEROS,
+	ICE_UNCOMPR_ST_RAW,
+	ICE_UNCOMPR_ST_ONE,
+	ICE_UNCOMPR_ST_ROW_COPY,
+	ICE_UNCOMPR_ST_LZ_TOKEN,
+	ICE_UNCOMPR_ST_LZ_LITERAL,
+	ICE_UNCOMPR_ST_LZ_COPY,
+	ICE_UNCOMPR_ST_DONE,
+	ICE_UNCOMPR_ST_ERROR
+};
+
+struct ice_uncompr
+{
+	int state;
+	char format;         // last byte of the magic: 'R', 'T' or 'L'
+	int last;            // the current opcode is the end of file opcode
+
+	uint64_t in_bits;    // input bits, MSB aligned
+	int in_nbits;
+
+	uint32_t count;      // ZERO, raw or copied bits (bytes for "lz") left
+	uint32_t distance;   // copy distance in bits (bytes for "lz")
+	uint32_t row_width;  // CRAM row width in bits ("tile")
+
+	uint8_t out_byte;    // output bits, MSB first
+	int out_nbits;
+
+	// output history ("tile" and "lz" only)
+	uint32_t window_pos;
+	uint8_t window[ICE_UNCOMPR_WINDOW];
+};
+
+// Opcodes by number of leading ZERO bits: length of the prefix and of the
+// count field. 3 is the raw opcode, 5 is end of file.
+static const int ice_uncompr_prefix_len[6] = { 1, 2, 3, 4, 5, 5 };
+static const int ice_uncompr_count_len[6] = { 2, 5, 8, 6, 23, 23 };
+
+static inline void ice_uncompr_init(struct ice_uncompr *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->state = ICE_UNCOMPR_ST_MAGIC;
+}
+
+static inline void ice_uncompr_consume(struct ice_uncompr *s, int bits)
+{
+	s->in_bits = bits < 64 ? s->in_bits << bits : 0;
+	s->in_nbits -= bits;
+}
+
+static inline void ice_uncompr_record(struct ice_uncompr *s, const uint8_t *data, size_t n)
+{
+	if (s->format == 'R')
+		return;
+	for (size_t i = 0; i < n; i++)
+		s->window[s->window_pos++ % ICE_UNCOMPR_WINDOW] = data[i];
+}
+
+// Decode as much as possible. Advances *in / *out and decrements *in_avail /
+// *out_avail by the number of bytes consumed / produced.
+static inline int ice_uncompr_run(struct ice_uncompr *s, const uint8_t **in, size_t *in_avail,
+		uint8_t **out, size_t *out_avail)
+{
+	while (1)
+	{
+		while (s->in_nbits <= 56 && *in_avail > 0) {
+			s->in_bits |= (uint64_t)*(*in)++ << (56 - s->in_nbits);
+			s->in_nbits += 8;
+			(*in_avail)--;
+		}
+
+		if (s->out_nbits == 8) {
+			if (*out_avail == 0)
+				return ICE_UNCOMPR_MORE;
+			ice_uncompr_record(s, &s->out_byte, 1);
+			*(*out)++ = s->out_byte;
+			(*out_avail)--;
+			s->out_byte = 0;
+			s->out_nbits = 0;
+		}
+
+		switch (s->state)
+		{
+		case ICE_UNCOMPR_ST_MAGIC:
+			if (s->in_nbits < 64)
+				return ICE_UNCOMPR_MORE;
+			s->format = s->in_bits & 0xff;
+			if ((s->in_bits >> 8) != 0x494345434f4d50ULL ||
+					(s->format != 'R' && s->format != 'T' && s->format != 'L')) {
+				s->state = ICE_UNCOMPR_ST_ERROR;
+				break;
+			}
+			ice_uncompr_consume(s, 64);
+			s->state = s->format == 'R' ? ICE_UNCOMPR_ST_OPCODE :
+					s->format == 'T' ? ICE_UNCOMPR_ST_ROW_WIDTH : ICE_UNCOMPR_ST_LZ_TOKEN;
+			break;
+
+		case ICE_UNCOMPR_ST_ROW_WIDTH:
+			if (s->in_nbits < 16)
+				return ICE_UNCOMPR_MORE;
+			s->row_width = s->in_bits >> 48;
+			ice_uncompr_consume(s, 16);
+			// copies reach back up to 16 rows
+			if (s->row_width < 8 || 16 * s->row_width > 8 * (ICE_UNCOMPR_WINDOW - 1)) {
+				s->state = ICE_UNCOMPR_ST_ERROR;
+				break;
+			}
+			s->state = ICE_UNCOMPR_ST_OPCODE;
+			break;
+
+		case ICE_UNCOMPR_ST_OPCODE: {
+			int op = 0;
+			while (op < 5 && op < s->in_nbits && !((s->in_bits >> (63 - op)) & 1))
+				op++;
+			if (op == s->in_nbits && op < 5)
+				return ICE_UNCOMPR_MORE;
+
+			int prefix_len = ice_uncompr_prefix_len[op];
+			int count_len = ice_uncompr_count_len[op];
+
+			// "tile": a flag bit after the d8M prefix selects between
+			// count[23] ZERO bits and a copy of len[16] bits from
+			// rows[4]+1 rows back
+			if (s->format == 'T' && op == 4) {
+				if (s->in_nbits < prefix_len + 1)
+					return ICE_UNCOMPR_MORE;
+				if ((s->in_bits >> (63 - prefix_len)) & 1) {
+					if (s->in_nbits < prefix_len + 21)
+						return ICE_UNCOMPR_MORE;
+					ice_uncompr_consume(s, prefix_len + 1);
+					s->distance = ((s->in_bits >> 60) + 1) * s->row_width;
+					s->count = (s->in_bits >> 44) & 0xffff;
+					ice_uncompr_consume(s, 20);
+					s->state = ICE_UNCOMPR_ST_ROW_COPY;
+					break;
+				}
+				prefix_len++;
+			}
+
+			if (s->in_nbits < prefix_len + count_len)
+				return ICE_UNCOMPR_MORE;
+
+			ice_uncompr_consume(s, prefix_len);
+			s->count = s->in_bits >> (64 - count_len);
+			ice_uncompr_consume(s, count_len);
+
+			s->last = op == 5;
+			s->state = op == 3 ? ICE_UNCOMPR_ST_RAW : ICE_UNCOMPR_ST_ZEROS;
+			break;
+		}
+
+		case ICE_UNCOMPR_ST_ZEROS:
+			// fill up the current byte, then write whole ZERO bytes
+			if (s->out_nbits > 0 || s->count < 8) {
+				int n = s->count < (uint32_t)(8 - s->out_nbits) ? (int)s->count : 8 - s->out_nbits;
+				s->out_nbits += n;
+				s->count -= n;
+			} else {
+				size_t n = s->count / 8 < *out_avail ? s->count / 8 : *out_avail;
+				if (n == 0)
+					return ICE_UNCOMPR_MORE;
+				memset(*out, 0, n);
+				ice_uncompr_record(s, *out, n);
+				*out += n;
+				*out_avail -= n;
+				s->count -= 8 * n;
+			}
+			if (s->count == 0) {
+				if (s->last) {
+					// drop an incomplete last byte, like the reference decoder
+					if (s->out_nbits == 8)
+						break;
+					s->state = ICE_UNCOMPR_ST_DONE;
+				} else {
+					s->state = ICE_UNCOMPR_ST_ONE;
+				}
+			}
+			break;
+
+		case ICE_UNCOMPR_ST_RAW: {
+			int n = 8 - s->out_nbits;
+			if (n > (int)s->count)
+				n = s->count;
+			if (n > s->in_nbits)
+				n = s->in_nbits;
+			if (n == 0 && s->count > 0)
+				return ICE_UNCOMPR_MORE;
+			if (n > 0) {
+				s->out_byte |= (uint8_t)(s->in_bits >> (64 - n)) << (8 - s->out_nbits - n);
+				s->out_nbits += n;
+				s->count -= n;
+				ice_uncompr_consume(s, n);
+			}
+			if (s->count == 0)
+				s->state = ICE_UNCOMPR_ST_ONE;
+			break;
+		}
+
+		case ICE_UNCOMPR_ST_ONE:
+			s->out_byte |= 0x80 >> s->out_nbits;
+			s->out_nbits++;
+			s->state = ICE_UNCOMPR_ST_OPCODE;
+			break;
+
+		case ICE_UNCOMPR_ST_ROW_COPY:
+			// the source is at least one row (>= 8 bits) back, so it is
+			// always in a completed byte
+			while (s->count > 0 && s->out_nbits < 8) {
+				uint32_t pos = 8 * s->window_pos + s->out_nbits - s->distance;
+				int bit = (s->window[(pos / 8) % ICE_UNCOMPR_WINDOW] >> (7 - pos % 8)) & 1;
+				s->out_byte |= bit << (7 - s->out_nbits);
+				s->out_nbits++;
+				s->count--;
+			}
+			if (s->count == 0)
+				s->state = ICE_UNCOMPR_ST_OPCODE;
+			break;
+
+		case ICE_UNCOMPR_ST_LZ_TOKEN:
+			// token < 0x80: token+1 literal bytes follow
+			// token < 0xff: copy (token & 0x7f) + 3 bytes from distance[16]+1 bytes back
+			// token = 0xff: end of file
+			if (s->in_nbits < 8)
+				return ICE_UNCOMPR_MORE;
+			s->count = s->in_bits >> 56;
+			if (s->count == 0xff) {
+				ice_uncompr_consume(s, 8);
+				s->state = ICE_UNCOMPR_ST_DONE;
+			} else if (s->count < 0x80) {
+				ice_uncompr_consume(s, 8);
+				s->count++;
+				s->state = ICE_UNCOMPR_ST_LZ_LITERAL;
+			} else {
+				if (s->in_nbits < 24)
+					return ICE_UNCOMPR_MORE;
+				s->count = (s->count & 0x7f) + 3;
+				s->distance = ((s->in_bits >> 40) & 0xffff) + 1;
+				ice_uncompr_consume(s, 24);
+				if (s->distance > ICE_UNCOMPR_WINDOW) {
+					s->state = ICE_UNCOMPR_ST_ERROR;
+					break;
+				}
+				s->state = ICE_UNCOMPR_ST_LZ_COPY;
+			}
+			break;
+
+		case ICE_UNCOMPR_ST_LZ_LITERAL:
+			if (s->in_nbits < 8)
+				return ICE_UNCOMPR_MORE;
+			s->out_byte = s->in_bits >> 56;
+			s->out_nbits = 8;
+			ice_uncompr_consume(s, 8);
+			if (--s->count == 0)
+				s->state = ICE_UNCOMPR_ST_LZ_TOKEN;
+			break;
+
+		case ICE_UNCOMPR_ST_LZ_COPY:
+			s->out_byte = s->window[(s->window_pos - s->distance) % ICE_UNCOMPR_WINDOW];
+			s->out_nbits = 8;
+			if (--s->count == 0)
+				s->state = ICE_UNCOMPR_ST_LZ_TOKEN;
+			break;
+
+		case ICE_UNCOMPR_ST_DONE:
+			return ICE_UNCOMPR_DONE;
+
+		default:
+			return ICE_UNCOMPR_ERROR;
+		}
+	}
+}
+
+#endif
@@ -14,25 +14,47 @@
 //  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 //
 
-#include <fstream>
-#include <iostream>
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#  define ICEMULTI_POSIX_IO
+#  include <limits.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/uio.h>
+#endif
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
+#include "../icecompr/icecompr.h"
+
 #define log(...) fprintf(stderr, __VA_ARGS__);
 #define error(...) do { fprintf(stderr, "%s: ", program_short_name); fprintf(stderr, __VA_ARGS__); exit(EXIT_FAILURE); } while (0)
 
 static char *program_short_name;
 
+// The output is written to a temporary file which replaces the output file
+// only after it has been written completely.
+static std::string output_tmp_name;
+
+static void remove_output_tmp()
+{
+    if (!output_tmp_name.empty())
+        remove(output_tmp_name.c_str());
+}
+
 static const int NUM_IMAGES = 4;
 static const int HEADER_SIZE = 32;
 
@@ -43,118 +65,271 @@ static void align_offset(uint32_t &offset, int bits)
         offset = (offset | mask) + 1;
 }
 
-static void write_byte(std::ostream &ofs, uint32_t &file_offset, uint8_t byte)
-{
-    ofs << byte;
-    file_offset++;
-}
+// The output file is assembled as a list of segments pointing into the
+// headers, the (mapped) input images and a shared buffer of padding bytes,
+// which is then written with as few system calls as possible.
+class OutputFile {
+    std::vector<std::pair<const uint8_t*, size_t>> segments;
+
+public:
+    uint32_t file_offset = 0;
 
-static void write_bytes(std::ostream &ofs, uint32_t &file_offset,
-                        const uint8_t *buf, size_t n)
+    void append(const uint8_t *buf, size_t n);
+    void pad_to(uint32_t target);
+    void write(FILE *f, const char *filename);
+    std::vector<std::pair<uint32_t, uint32_t>> changed_sectors(const uint8_t *prev, size_t prev_size,
+                                                               uint32_t sector_size) const;
+};
+
+void OutputFile::append(const uint8_t *buf, size_t n)
 {
     if (n > 0) {
-        ofs.write(reinterpret_cast<const char*>(buf), n);
+        segments.push_back(std::make_pair(buf, n));
         file_offset += n;
     }
 }
 
-static void write_file(std::ostream &ofs, uint32_t &file_offset,
-                       std::istream &ifs, const char *filename)
+void OutputFile::pad_to(uint32_t target)
 {
-    const size_t bufsize = 8192;
-    uint8_t *buffer = new uint8_t[bufsize];
+    static std::vector<uint8_t> padding(65536, 0xff);
 
-    while(!ifs.eof()) {
-        ifs.read(reinterpret_cast<char *>(buffer), bufsize);
-        if (ifs.bad())
-            error("can't read input image `%s': %s\n", filename, strerror(errno));
-        write_bytes(ofs, file_offset, buffer, ifs.gcount());
+    if (target < file_offset)
+        error("Trying to pad backwards!\n");
+    while (file_offset < target)
+        append(padding.data(), std::min<size_t>(target - file_offset, padding.size()));
+}
+
+void OutputFile::write(FILE *f, const char *filename)
+{
+#ifdef ICEMULTI_POSIX_IO
+    fflush(f);
+
+    std::vector<struct iovec> iov;
+    for (auto &seg : segments) {
+        struct iovec v;
+        v.iov_base = const_cast<uint8_t*>(seg.first);
+        v.iov_len = seg.second;
+        iov.push_back(v);
     }
 
-    delete[] buffer;
+    for (size_t i = 0; i < iov.size();) {
+        ssize_t rc = writev(fileno(f), &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            error("can't write output file `%s': %s\n", filename, strerror(errno));
+        }
+        // skip completely written segments, adjust a partially written one
+        while (i < iov.size() && size_t(rc) >= iov[i].iov_len)
+            rc -= iov[i++].iov_len;
+        if (rc > 0) {
+            iov[i].iov_base = static_cast<uint8_t*>(iov[i].iov_base) + rc;
+            iov[i].iov_len -= rc;
+        }
+    }
+#else
+    for (auto &seg : segments)
+        if (fwrite(seg.first, 1, seg.second, f) != seg.second)
+            error("can't write output file `%s': %s\n", filename, strerror(errno));
+    if (fflush(f) != 0)
+        error("can't write output file `%s': %s\n", filename, strerror(errno));
+#endif
 }
 
-static void pad_to(std::ostream &ofs, uint32_t &file_offset, uint32_t target)
+// Length of an icepack style bitstream up to and including the wakeup
+// command and the padding byte after it, 0 if the data can't be parsed.
+static size_t bitstream_length(const uint8_t *data, size_t size)
 {
-    if (target < file_offset)
-        error("Trying to pad backwards!\n");
-    while(file_offset < target)
-        write_byte(ofs, file_offset, 0xff);
+    size_t i = 0;
+    while (i + 4 <= size && !(data[i] == 0x7e && data[i+1] == 0xaa && data[i+2] == 0x99 && data[i+3] == 0x7e))
+        i++;
+    if (i + 4 > size)
+        return 0;
+
+    uint32_t width = 0, height = 0;
+
+    for (i += 4; i < size;)
+    {
+        // one command byte, the lower 4 bits are the payload length
+        uint8_t command = data[i++];
+        uint32_t payload = 0;
+        for (int k = 0; k < (command & 0x0f); k++) {
+            if (i == size)
+                return 0;
+            payload = (payload << 8) | data[i++];
+        }
+
+        if (command == 0x62)
+            width = payload + 1;
+        else if (command == 0x72)
+            height = payload;
+        else if (command == 0x01 && (payload == 0x01 || payload == 0x03))
+            i += width * height / 8 + 2;   // CRAM/BRAM data and 0x0000
+        else if (command == 0x01 && payload == 0x06)
+            return std::min(i + 1, size);
+    }
+
+    return 0;
+}
+
+// Ranges [begin, end) of sectors with contents that differ from the
+// previous output, adjacent sectors are merged
+std::vector<std::pair<uint32_t, uint32_t>> OutputFile::changed_sectors(const uint8_t *prev, size_t prev_size,
+                                                                       uint32_t sector_size) const
+{
+    std::vector<bool> changed((file_offset + sector_size - 1) / sector_size);
+
+    uint32_t offset = 0;
+    for (auto &seg : segments) {
+        for (size_t pos = 0; pos < seg.second;) {
+            uint32_t sector = (offset + pos) / sector_size;
+            size_t n = std::min<size_t>(seg.second - pos, (sector + 1) * sector_size - (offset + pos));
+            if (!changed[sector] && (offset + pos + n > prev_size ||
+                                     memcmp(seg.first + pos, prev + offset + pos, n)))
+                changed[sector] = true;
+            pos += n;
+        }
+        offset += seg.second;
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (uint32_t sector = 0; sector < changed.size(); sector++) {
+        if (!changed[sector])
+            continue;
+        uint32_t begin = sector * sector_size;
+        uint32_t end = std::min(begin + sector_size, file_offset);
+        if (!ranges.empty() && ranges.back().second == begin)
+            ranges.back().second = end;
+        else
+            ranges.push_back(std::make_pair(begin, end));
+    }
+    return ranges;
 }
 
 class Image {
-    std::ifstream ifs;
-    uint32_t offs;
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    size_t file_size_ = 0;
+    const uint8_t *map_data = nullptr;
+    bool mapped = false;
+    std::vector<uint8_t> buffer;
+    uint32_t offs = 0;
 
 public:
     const char *const filename;
 
     Image(const char *filename);
-    size_t size();
-    void write(std::ostream &ofs, uint32_t &file_offset);
+    ~Image();
+    void strip();
+    void compress();
+    size_t size() const { return size_; }
+    size_t file_size() const { return file_size_; }
+    const uint8_t *data() const { return data_; }
+    void write(OutputFile &out) const { out.append(data_, size_); }
     void place(uint32_t o) { offs = o; }
     uint32_t offset() const { return offs; }
 };
 
-Image::Image(const char *filename) : ifs(filename, std::ifstream::binary), filename(filename)
+Image::Image(const char *filename) : filename(filename)
 {
-    if (ifs.fail())
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
         error("can't open input image `%s': %s\n", filename, strerror(errno));
+
+#ifdef ICEMULTI_POSIX_IO
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (p != MAP_FAILED) {
+            data_ = map_data = static_cast<const uint8_t*>(p);
+            size_ = st.st_size;
+            mapped = true;
+        }
+    }
+#endif
+
+    if (!mapped) {
+        uint8_t chunk[8192];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        if (ferror(f))
+            error("can't read input image `%s': %s\n", filename, strerror(errno));
+        data_ = buffer.data();
+        size_ = buffer.size();
+    }
+
+    fclose(f);
+
+    if (size_ == 0)
+        error("input image `%s' doesn't contain any data\n", filename);
+    file_size_ = size_;
 }
 
-size_t Image::size()
+// Drop everything after the wakeup command (e.g. 0xff padding of images
+// read back from flash)
+void Image::strip()
 {
-    ifs.seekg (0, ifs.end);
-    if (ifs.fail())
-        error("can't seek on input image `%s': %s\n", filename, strerror(errno));
-    size_t length = ifs.tellg();
-    ifs.seekg (0, ifs.beg);
-    if (ifs.fail())
-        error("can't seek on input image `%s': %s\n", filename, strerror(errno));
-
+    size_t length = bitstream_length(data_, size_);
     if (length == 0)
-        error("input image `%s' doesn't contain any data\n", filename);
-    return length;
+        error("input image `%s' is not a valid bitstream\n", filename);
+    size_ = length;
 }
 
-void Image::write(std::ostream &ofs, uint32_t &file_offset)
+// Replace the image by its icecompr compressed version. Such images can't be
+// booted by the FPGA itself, they are meant for a microcontroller that reads
+// the headers and uncompresses the selected image.
+void Image::compress()
 {
-    write_file(ofs, file_offset, ifs, filename);
+    std::vector<uint8_t> compressed;
+    ice_compress_bytes(compressed, std::vector<uint8_t>(data_, data_ + size_), "rle");
+    buffer.swap(compressed);
+    data_ = buffer.data();
+    size_ = buffer.size();
 }
 
-static void write_header(std::ostream &ofs, uint32_t &file_offset,
-                         Image const *image, bool coldboot)
+Image::~Image()
 {
+#ifdef ICEMULTI_POSIX_IO
+    if (mapped)
+        munmap(const_cast<uint8_t*>(map_data), file_size_);
+#endif
+}
+
+static void write_header(uint8_t *buf, Image const *image, bool coldboot)
+{
+    int n = 0;
+
     // Preamble
-    write_byte(ofs, file_offset, 0x7e);
-    write_byte(ofs, file_offset, 0xaa);
-    write_byte(ofs, file_offset, 0x99);
-    write_byte(ofs, file_offset, 0x7e);
+    buf[n++] = 0x7e;
+    buf[n++] = 0xaa;
+    buf[n++] = 0x99;
+    buf[n++] = 0x7e;
 
     // Boot mode
-    write_byte(ofs, file_offset, 0x92);
-    write_byte(ofs, file_offset, 0x00);
-    write_byte(ofs, file_offset, coldboot ? 0x10 : 0x00);
+    buf[n++] = 0x92;
+    buf[n++] = 0x00;
+    buf[n++] = coldboot ? 0x10 : 0x00;
 
     // Boot address
-    write_byte(ofs, file_offset, 0x44);
-    write_byte(ofs, file_offset, 0x03);
-    write_byte(ofs, file_offset, (image->offset() >> 16) & 0xff);
-    write_byte(ofs, file_offset, (image->offset() >> 8) & 0xff);
-    write_byte(ofs, file_offset, image->offset() & 0xff);
+    buf[n++] = 0x44;
+    buf[n++] = 0x03;
+    buf[n++] = (image->offset() >> 16) & 0xff;
+    buf[n++] = (image->offset() >> 8) & 0xff;
+    buf[n++] = image->offset() & 0xff;
 
     // Bank offset
-    write_byte(ofs, file_offset, 0x82);
-    write_byte(ofs, file_offset, 0x00);
-    write_byte(ofs, file_offset, 0x00);
+    buf[n++] = 0x82;
+    buf[n++] = 0x00;
+    buf[n++] = 0x00;
 
     // Reboot
-    write_byte(ofs, file_offset, 0x01);
-    write_byte(ofs, file_offset, 0x08);
+    buf[n++] = 0x01;
+    buf[n++] = 0x08;
 
     // Zero out any unused bytes
-    while (file_offset & (HEADER_SIZE - 1))
-        write_byte(ofs, file_offset, 0x00);
+    while (n < HEADER_SIZE)
+        buf[n++] = 0x00;
 }
 
 void usage()
@@ -171,11 +346,32 @@ void usage()
     log(" -a<n>, -A<n>\n");
     log(" align images at 2^<n> bytes. -A also aligns image 0.\n");
     log("\n");
+    log(" -s\n");
+    log(" strip everything after the wakeup command from the images\n");
+    log("\n");
+    log(" -z\n");
+    log(" strip and store the images compressed with icecompr. The FPGA can't boot such\n");
+    log(" images, they must be uncompressed by e.g. a microcontroller that reads\n");
+    log(" the boot addresses from the headers.\n");
+    log("\n");
+    log(" -f<size>\n");
+    log(" size of the flash (append 'k' or 'M'), fail if the images don't fit\n");
+    log("\n");
+    log(" -d filename\n");
+    log(" previous output image for -m\n");
+    log("\n");
+    log(" -m filename\n");
+    log(" write a map of the flash sectors that changed compared to the image\n");
+    log(" given with -d (all sectors without -d), for use with `iceprog -M'\n");
+    log("\n");
+    log(" -e<size>\n");
+    log(" sector size for -m, 4k, 32k or 64k [default: 64k]\n");
+    log("\n");
     log(" -o filename\n");
     log(" write output image to file instead of stdout\n");
     log("\n");
     log(" -v\n");
-    log(" verbose (repeat to increase verbosity)\n");
+    log(" verbose, print the flash map\n");
     log("\n");
     exit(EXIT_FAILURE);
 }
@@ -206,6 +402,12 @@ int main(int argc, char **argv)
     std::unique_ptr<Image> images[NUM_IMAGES];
     const char *outfile_name = NULL;
     bool print_offsets = false;
+    bool strip_images = false;
+    bool compress_images = false;
+    long flash_size = 0;
+    const char *previous_name = NULL;
+    const char *sector_map_name = NULL;
+    long sector_size = 65536;
 
     static struct option long_options[] = {
         {NULL, 0, NULL, 0}
@@ -217,7 +419,7 @@ int main(int argc, char **argv)
     else
         program_short_name++;
 
-    while ((c = getopt_long(argc, argv, "cp:a:A:o:v",
+    while ((c = getopt_long(argc, argv, "cp:a:A:szf:d:m:e:o:v",
                 long_options, NULL)) != -1)
         switch (c) {
             case 'c':
@@ -245,6 +447,39 @@ int main(int argc, char **argv)
                 if (align_bits < 0)
                     error("argument to `-%c' must be non-negative\n", c);
                 break;
+            case 's':
+                strip_images = true;
+                break;
+            case 'z':
+                compress_images = true;
+                break;
+            case 'f':
+                flash_size = strtol(optarg, &endptr, 0);
+                if (!strcmp(endptr, "k"))
+                    flash_size *= 1024;
+                else if (!strcmp(endptr, "M"))
+                    flash_size *= 1024 * 1024;
+                else if (*endptr != '\0')
+                    error("`%s' is not a valid size\n", optarg);
+                if (flash_size <= 0)
+                    error("argument to `-f' must be positive\n");
+                break;
+            case 'd':
+                previous_name = optarg;
+                break;
+            case 'm':
+                sector_map_name = optarg;
+                break;
+            case 'e':
+                if (!strcmp(optarg, "4k"))
+                    sector_size = 4096;
+                else if (!strcmp(optarg, "32k"))
+                    sector_size = 32768;
+                else if (!strcmp(optarg, "64k"))
+                    sector_size = 65536;
+                else
+                    error("`%s' is not a valid sector size (must be 4k, 32k, or 64k)\n", optarg);
+                break;
             case 'o':
                 outfile_name = optarg;
                 break;
@@ -283,6 +518,22 @@ int main(int argc, char **argv)
     if (por_image >= header_count)
         error("Specified non-existing image for power on reset\n");
 
+    if (previous_name != NULL && sector_map_name == NULL)
+        error("option `-d' requires `-m'\n");
+
+    // load the previous image before the output file (which may be the
+    // same file) is replaced
+    std::unique_ptr<Image> previous;
+    if (previous_name != NULL)
+        previous.reset(new Image(previous_name));
+
+    for (int i=0; i<image_count; i++) {
+        if (strip_images || compress_images)
+            images[i]->strip();
+        if (compress_images)
+            images[i]->compress();
+    }
+
     // Place images
     uint32_t offs = (NUM_IMAGES + 1) * HEADER_SIZE;
     if (align_first)
@@ -295,35 +546,99 @@ int main(int argc, char **argv)
             fprintf(stderr, "Place image %d at %06x .. %06x (`%s')\n", i, int(images[i]->offset()), int(offs), images[i]->filename);
     }
 
+    if (print_offsets) {
+        fprintf(stderr, "Flash map:\n");
+        fprintf(stderr, "  %06x .. %06x  headers\n", 0, (NUM_IMAGES + 1) * HEADER_SIZE);
+        for (int i=0; i<image_count; i++)
+            fprintf(stderr, "  %06x .. %06x  image %d, %d of %d bytes%s (`%s')\n",
+                    int(images[i]->offset()), int(images[i]->offset() + images[i]->size()), i,
+                    int(images[i]->size()), int(images[i]->file_size()),
+                    compress_images ? " compressed" : strip_images ? " stripped" : "", images[i]->filename);
+        uint32_t end = images[image_count - 1]->offset() + images[image_count - 1]->size();
+        if (end <= flash_size)
+            fprintf(stderr, "  %06x .. %06x  free (%ld bytes)\n", int(end), int(flash_size),
+                    std::max(0L, flash_size - long(end)));
+    }
+
+    if (flash_size > 0 && long(images[image_count - 1]->offset() + images[image_count - 1]->size()) > flash_size)
+        error("images don't fit into a flash of %ld bytes\n", flash_size);
+
     // Populate headers
     for (int i=header_count; i < NUM_IMAGES; i++)
         header_images[i] = header_images[por_image];
 
-    std::ofstream ofs;
-    std::ostream *osp;
+    FILE *f = stdout;
 
     if (outfile_name != NULL) {
-        ofs.open(outfile_name, std::ofstream::binary);
-        if (!ofs.is_open())
-            error("can't open output file `%s': %s\n", outfile_name, strerror(errno));
-        osp = &ofs;
-    } else {
-        osp = &std::cout;
+        bool replace = true;
+#ifdef ICEMULTI_POSIX_IO
+        // devices and pipes (e.g. /dev/stdout) are written directly
+        struct stat st;
+        if (stat(outfile_name, &st) == 0 && !S_ISREG(st.st_mode))
+            replace = false;
+#endif
+        if (replace) {
+            output_tmp_name = std::string(outfile_name) + ".tmp";
+            atexit(remove_output_tmp);
+        }
+        const char *name = replace ? output_tmp_name.c_str() : outfile_name;
+        f = fopen(name, "wb");
+        if (f == NULL)
+            error("can't open output file `%s': %s\n", name, strerror(errno));
     }
 
-    uint32_t file_offset = 0;
+    OutputFile out;
+    uint8_t headers[NUM_IMAGES + 1][HEADER_SIZE];
+
     for (int i=0; i<NUM_IMAGES + 1; i++)
     {
-        pad_to(*osp, file_offset, i * HEADER_SIZE);
         if (i == 0)
-            write_header(*osp, file_offset, header_images[por_image], coldboot);
+            write_header(headers[i], header_images[por_image], coldboot);
         else
-            write_header(*osp, file_offset, header_images[i - 1], false);
+            write_header(headers[i], header_images[i - 1], false);
+        out.append(headers[i], HEADER_SIZE);
     }
     for (int i=0; i<image_count; i++)
     {
-        pad_to(*osp, file_offset, images[i]->offset());
-        images[i]->write(*osp, file_offset);
+        out.pad_to(images[i]->offset());
+        images[i]->write(out);
+    }
+
+    if (sector_map_name != NULL) {
+        auto ranges = out.changed_sectors(previous ? previous->data() : nullptr,
+                                          previous ? previous->size() : 0, sector_size);
+
+        FILE *mf = fopen(sector_map_name, "w");
+        if (mf == NULL)
+            error("can't open sector map file `%s': %s\n", sector_map_name, strerror(errno));
+        fprintf(mf, "# icemulti sector map: offset length (sector size %ld, image size %d)\n",
+                sector_size, int(out.file_offset));
+        uint32_t changed_bytes = 0;
+        for (auto &r : ranges) {
+            fprintf(mf, "0x%06x 0x%06x\n", int(r.first), int(r.second - r.first));
+            changed_bytes += r.second - r.first;
+        }
+        if (fclose(mf) != 0)
+            error("can't write sector map file `%s': %s\n", sector_map_name, strerror(errno));
+
+        if (print_offsets)
+            fprintf(stderr, "Changed: %d of %d bytes in %d ranges\n", int(changed_bytes),
+                    int(out.file_offset), int(ranges.size()));
+    }
+
+    out.write(f, outfile_name ? outfile_name : "<stdout>");
+
+    if (f != stdout && fclose(f) != 0)
+        error("can't write output file `%s': %s\n", outfile_name, strerror(errno));
+
+    if (!output_tmp_name.empty()) {
+#ifdef _WIN32
+        // rename() doesn't replace an existing file on Windows
+        remove(outfile_name);
+#endif
+        if (rename(output_tmp_name.c_str(), outfile_name) != 0)
+            error("can't rename `%s' to `%s': %s\n", output_tmp_name.c_str(), outfile_name, strerror(errno));
+        output_tmp_name.clear();
     }
 
     return EXIT_SUCCESS;
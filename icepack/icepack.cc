@@ -38,6 +38,8 @@
 #include <emscripten.h>
 #endif
 
+#include "../common/ascparse.h"
+
 #ifdef _WIN32
 #define __PRETTY_FUNCTION__ __FUNCTION__
 #endif
@@ -121,7 +123,7 @@ struct FpgaConfig
 	void write_bits(std::ostream &ofs) const;
 
 	// icebox i/o
-	void read_ascii(std::istream &ifs, bool nosleep);
+	void read_ascii(const AscFile &asc, bool nosleep);
 	void write_ascii(std::ostream &ofs) const;
 
 	// netpbm i/o
@@ -609,247 +611,275 @@ void FpgaConfig::write_bits(std::ostream &ofs) const
 	write_byte(ofs, crc_value, file_offset, 0x00);
 }
 
-void FpgaConfig::read_ascii(std::istream &ifs, bool nosleep)
+struct AsciiReader : AscVisitor
 {
-	debug("## %s\n", __PRETTY_FUNCTION__);
-	info("Parsing ascii file..\n");
-
+	FpgaConfig *fpga;
 	bool got_device = false;
-	this->cram.clear();
-	this->bram.clear();
-	this->freqrange = "low";
-	this->warmboot = "enabled";
+	bool in_comment = false;
+
+	CramIndexConverter *cic = nullptr;
+	BramIndexConverter *bic = nullptr;
 
-	bool reuse_line = true;
-	string line, command;
+	AsciiReader(FpgaConfig *fpga) : fpga(fpga) { }
 
-	while (reuse_line || getline(ifs, line))
+	void get_tile_args(const AscStatement &stmt, int &tile_x, int &tile_y)
 	{
-		reuse_line = false;
+		tile_x = stmt.int_arg(0);
+		tile_y = stmt.int_arg(1);
 
-		std::istringstream is(line);
-		is >> command;
+		if (tile_x < 0 || tile_x > fpga->chip_width()+1 || tile_y < 0 || tile_y > fpga->chip_height()+1)
+			error("Invalid tile coordinates in line %d: %s\n", stmt.line_nr, stmt.line.str().c_str());
+	}
 
-		if (command.empty())
-			continue;
+	~AsciiReader()
+	{
+		delete cic;
+		delete bic;
+	}
 
-		debug("Next command: %s\n", line.c_str());
+	void end_comment()
+	{
+		if (in_comment) {
+			fpga->initblop.push_back(0x00);
+			fpga->initblop.push_back(0xff);
+			in_comment = false;
+		}
+	}
 
-		if (command == ".comment")
-		{
-			this->initblop.clear();
-			this->initblop.push_back(0xff);
-			this->initblop.push_back(0x00);
+	void asc_statement(const AscStatement &stmt) override
+	{
+		delete cic;
+		delete bic;
+		cic = nullptr;
+		bic = nullptr;
 
-			while (getline(ifs, line))
-			{
-				if (line.substr(0, 1) == ".") {
-					reuse_line = true;
-					break;
-				}
+		end_comment();
 
-				for (auto ch : line)
-					this->initblop.push_back(ch);
-				this->initblop.push_back(0);
-			}
+		debug("Next command: %s\n", stmt.line.str().c_str());
 
-			this->initblop.push_back(0x00);
-			this->initblop.push_back(0xff);
-			continue;
+		if (stmt.keyword == ".comment")
+		{
+			fpga->initblop.clear();
+			fpga->initblop.push_back(0xff);
+			fpga->initblop.push_back(0x00);
+			in_comment = true;
+			return;
 		}
 
-		if (command == ".device")
+		if (stmt.keyword == ".device")
 		{
 			if (got_device)
 				error("More than one .device statement.\n");
 
-			is >> this->device;
+			if (stmt.nargs >= 1)
+				fpga->device = stmt.args[0].str();
 
-			if (this->device == "384") {
-				this->cram_width = 182;
-				this->cram_height = 80;
-				this->bram_width = 0;
-				this->bram_height = 0;
+			if (fpga->device == "384") {
+				fpga->cram_width = 182;
+				fpga->cram_height = 80;
+				fpga->bram_width = 0;
+				fpga->bram_height = 0;
 			} else
-			if (this->device == "1k") {
-				this->cram_width = 332;
-				this->cram_height = 144;
-				this->bram_width = 64;
-				this->bram_height = 2 * 128;
+			if (fpga->device == "1k") {
+				fpga->cram_width = 332;
+				fpga->cram_height = 144;
+				fpga->bram_width = 64;
+				fpga->bram_height = 2 * 128;
 			} else
-			if (this->device == "8k") {
-				this->cram_width = 872;
-				this->cram_height = 272;
-				this->bram_width = 128;
-				this->bram_height = 2 * 128;
+			if (fpga->device == "8k") {
+				fpga->cram_width = 872;
+				fpga->cram_height = 272;
+				fpga->bram_width = 128;
+				fpga->bram_height = 2 * 128;
 			} else
-			if (this->device == "5k") {
-				this->cram_width = 692;
-				this->cram_height = 336;
-				this->bram_width = 160;
-				this->bram_height = 2 * 128;
+			if (fpga->device == "5k") {
+				fpga->cram_width = 692;
+				fpga->cram_height = 336;
+				fpga->bram_width = 160;
+				fpga->bram_height = 2 * 128;
 			} else
-			if (this->device == "u4k") {
-				this->cram_width = 692;
-				this->cram_height = 176;
-				this->bram_width = 80;
-				this->bram_height = 2 * 128;
+			if (fpga->device == "u4k") {
+				fpga->cram_width = 692;
+				fpga->cram_height = 176;
+				fpga->bram_width = 80;
+				fpga->bram_height = 2 * 128;
 			} else
-			if (this->device == "lm4k") {
-				this->cram_width = 656;
-				this->cram_height = 176;
-				this->bram_width = 80;
-				this->bram_height = 2 * 128;
+			if (fpga->device == "lm4k") {
+				fpga->cram_width = 656;
+				fpga->cram_height = 176;
+				fpga->bram_width = 80;
+				fpga->bram_height = 2 * 128;
 			} else
-				error("Unsupported chip type '%s'.\n", this->device.c_str());
+				error("Unsupported chip type '%s'.\n", fpga->device.c_str());
 
-			this->cram.resize(4);
-			if(this->device == "5k") {
+			fpga->cram.resize(4);
+			if(fpga->device == "5k") {
 				for (int i = 0; i < 4; i++) {
-					this->cram[i].resize(this->cram_width);
-					for (int x = 0; x < this->cram_width; x++)
-						this->cram[i][x].resize(((i % 2) == 1) ? (this->cram_height / 2 + 8) : this->cram_height);
+					fpga->cram[i].resize(fpga->cram_width);
+					for (int x = 0; x < fpga->cram_width; x++)
+						fpga->cram[i][x].resize(((i % 2) == 1) ? (fpga->cram_height / 2 + 8) : fpga->cram_height);
 				}
 
-				this->bram.resize(4);
+				fpga->bram.resize(4);
 				for (int i = 0; i < 4; i++) {
-					int width = ((i % 2) == 1) ? (this->bram_width / 2) : this->bram_width;
-					this->bram[i].resize(width);
+					int width = ((i % 2) == 1) ? (fpga->bram_width / 2) : fpga->bram_width;
+					fpga->bram[i].resize(width);
 					for (int x = 0; x < width; x++)
-						this->bram[i][x].resize(this->bram_height);
+						fpga->bram[i][x].resize(fpga->bram_height);
 				}
 			} else {
 				for (int i = 0; i < 4; i++) {
-					this->cram[i].resize(this->cram_width);
-					for (int x = 0; x < this->cram_width; x++)
-						this->cram[i][x].resize(this->cram_height);
+					fpga->cram[i].resize(fpga->cram_width);
+					for (int x = 0; x < fpga->cram_width; x++)
+						fpga->cram[i][x].resize(fpga->cram_height);
 				}
 
-				this->bram.resize(4);
+				fpga->bram.resize(4);
 				for (int i = 0; i < 4; i++) {
-					this->bram[i].resize(this->bram_width);
-					for (int x = 0; x < this->bram_width; x++)
-						this->bram[i][x].resize(this->bram_height);
+					fpga->bram[i].resize(fpga->bram_width);
+					for (int x = 0; x < fpga->bram_width; x++)
+						fpga->bram[i][x].resize(fpga->bram_height);
 				}
 			}
 
-
 			got_device = true;
-			continue;
+			return;
 		}
 
-		if (command == ".warmboot")
+		if (stmt.keyword == ".warmboot")
 		{
-			is >> this->warmboot;
+			if (stmt.nargs >= 1)
+				fpga->warmboot = stmt.args[0].str();
 
-			if (this->warmboot != "disabled" &&
-			    this->warmboot != "enabled")
+			if (fpga->warmboot != "disabled" &&
+			    fpga->warmboot != "enabled")
 				error("Unknown warmboot setting '%s'.\n",
-				      this->warmboot.c_str());
+				      fpga->warmboot.c_str());
 
-			continue;
+			return;
 		}
 
-		// No ".nosleep" section despite sharing the same byte as .warmboot.
-		// ".nosleep" is specified when icepack is invoked, which is too late.
-		// So we inject the section based on command line argument.
-		if (nosleep)
-			this->nosleep = "enabled";
-		else
-			this->nosleep = "disabled";
-
-		if (command == ".io_tile" || command == ".logic_tile" || command == ".ramb_tile" || command == ".ramt_tile" || command.substr(0, 4) == ".dsp" || command == ".ipcon_tile")
+		if (stmt.keyword == ".io_tile" || stmt.keyword == ".logic_tile" || stmt.keyword == ".ramb_tile" || stmt.keyword == ".ramt_tile" || stmt.keyword.starts_with(".dsp") || stmt.keyword == ".ipcon_tile")
 		{
 			if (!got_device)
-				error("Missing .device statement before %s.\n", command.c_str());
+				error("Missing .device statement before %s.\n", stmt.keyword.str().c_str());
 
 			int tile_x, tile_y;
-			is >> tile_x >> tile_y;
+			get_tile_args(stmt, tile_x, tile_y);
+			cic = new CramIndexConverter(fpga, tile_x, tile_y);
 
-			CramIndexConverter cic(this, tile_x, tile_y);
-
-			if (("." + cic.tile_type + "_tile") != command)
+			if (("." + cic->tile_type + "_tile") != stmt.keyword.str())
 				error("Got %s statement for %s tile %d %d.\n",
-						command.c_str(), cic.tile_type.c_str(), tile_x, tile_y);
+						stmt.keyword.str().c_str(), cic->tile_type.c_str(), tile_x, tile_y);
 
-			for (int bit_y = 0; bit_y < 16 && getline(ifs, line); bit_y++)
-			{
-				if (line.substr(0, 1) == ".") {
-					reuse_line = true;
-					break;
-				}
+			return;
+		}
 
-				for (int bit_x = 0; bit_x < int(line.size()) && bit_x < cic.tile_width; bit_x++)
-					if (line[bit_x] == '1') {
-						int cram_bank, cram_x, cram_y;
-						cic.get_cram_index(bit_x, bit_y, cram_bank, cram_x, cram_y);
-						this->cram[cram_bank][cram_x][cram_y] = true;
-					}
-			}
+		if (stmt.keyword == ".ram_data")
+		{
+			if (!got_device)
+				error("Missing .device statement before %s.\n", stmt.keyword.str().c_str());
 
-			continue;
+			int tile_x, tile_y;
+			get_tile_args(stmt, tile_x, tile_y);
+
+			if (fpga->tile_type(tile_x, tile_y) != "ramb")
+				error("Got %s statement for %s tile %d %d.\n",
+						stmt.keyword.str().c_str(), fpga->tile_type(tile_x, tile_y).c_str(), tile_x, tile_y);
+
+			bic = new BramIndexConverter(fpga, tile_x, tile_y);
+			return;
 		}
 
-		if (command == ".ram_data")
+		if (stmt.keyword == ".extra_bit")
 		{
 			if (!got_device)
-				error("Missing .device statement before %s.\n", command.c_str());
+				error("Missing .device statement before %s.\n", stmt.keyword.str().c_str());
 
-			int tile_x, tile_y;
-			is >> tile_x >> tile_y;
+			int cram_bank = stmt.int_arg(0), cram_x = stmt.int_arg(1), cram_y = stmt.int_arg(2);
 
-			BramIndexConverter bic(this, tile_x, tile_y);
+			if (cram_bank < 0 || cram_bank >= int(fpga->cram.size()) ||
+			    cram_x < 0 || cram_x >= int(fpga->cram[cram_bank].size()) ||
+			    cram_y < 0 || cram_y >= int(fpga->cram[cram_bank][cram_x].size()))
+				error("Invalid extra bit in line %d: %s\n", stmt.line_nr, stmt.line.str().c_str());
 
-			for (int bit_y = 0; bit_y < 16 && getline(ifs, line); bit_y++)
-			{
-				if (line.substr(0, 1) == ".") {
-					reuse_line = true;
-					break;
-				}
+			fpga->cram[cram_bank][cram_x][cram_y] = true;
 
-				for (int bit_x = 256-4, ch_idx = 0; ch_idx < int(line.size()) && bit_x >= 0; bit_x -= 4, ch_idx++)
-				{
-					int value = -1;
-					if ('0' <= line[ch_idx] && line[ch_idx] <= '9')
-						value = line[ch_idx] - '0';
-					if ('a' <= line[ch_idx] && line[ch_idx] <= 'f')
-						value = line[ch_idx] - 'a' + 10;
-					if ('A' <= line[ch_idx] && line[ch_idx] <= 'F')
-						value = line[ch_idx] - 'A' + 10;
-					if (value < 0)
-						error("Not a hex character: '%c' (in line '%s')\n", line[ch_idx], line.c_str());
-
-					for (int i = 0; i < 4; i++)
-						if ((value & (1 << i)) != 0) {
-							int bram_bank, bram_x, bram_y;
-							bic.get_bram_index(bit_x+i, bit_y, bram_bank, bram_x, bram_y);
-							this->bram[bram_bank][bram_x][bram_y] = true;
-						}
-				}
-			}
+			return;
+		}
 
-			continue;
+		if (stmt.keyword == ".sym")
+			return;
+
+		error("Unknown statement: %s\n", stmt.keyword.str().c_str());
+	}
+
+	void asc_data(const AscStatement &, int bit_y, const AscToken &line) override
+	{
+		if (in_comment)
+		{
+			for (int i = 0; i < line.len; i++)
+				fpga->initblop.push_back(line.ptr[i]);
+			fpga->initblop.push_back(0);
+			return;
 		}
 
-		if (command == ".extra_bit")
+		if (cic != nullptr && bit_y < 16)
 		{
-			if (!got_device)
-				error("Missing .device statement before %s.\n", command.c_str());
+			for (int bit_x = 0; bit_x < line.len && bit_x < cic->tile_width; bit_x++)
+				if (line.ptr[bit_x] == '1') {
+					int cram_bank, cram_x, cram_y;
+					cic->get_cram_index(bit_x, bit_y, cram_bank, cram_x, cram_y);
+					fpga->cram[cram_bank][cram_x][cram_y] = true;
+				}
+			return;
+		}
 
-			int cram_bank, cram_x, cram_y;
-			is >> cram_bank >> cram_x >> cram_y;
-			this->cram[cram_bank][cram_x][cram_y] = true;
+		if (bic != nullptr && bit_y < 16)
+		{
+			for (int bit_x = 256-4, ch_idx = 0; ch_idx < line.len && bit_x >= 0; bit_x -= 4, ch_idx++)
+			{
+				int value = asc_hex_digit(line.ptr[ch_idx]);
+				if (value < 0)
+					error("Not a hex character: '%c' (in line '%s')\n", line.ptr[ch_idx], line.str().c_str());
 
-			continue;
+				for (int i = 0; i < 4; i++)
+					if ((value & (1 << i)) != 0) {
+						int bram_bank, bram_x, bram_y;
+						bic->get_bram_index(bit_x+i, bit_y, bram_bank, bram_x, bram_y);
+						fpga->bram[bram_bank][bram_x][bram_y] = true;
+					}
+			}
+			return;
 		}
 
-		if (command == ".sym")
-		  continue;
-
-		if (command.substr(0, 1) == ".")
-			error("Unknown statement: %s\n", command.c_str());
-		error("Unexpected data line: %s\n", line.c_str());
+		for (int i = 0; i < line.len; i++)
+			if (line.ptr[i] != ' ' && line.ptr[i] != '\t')
+				error("Unexpected data line: %s\n", line.str().c_str());
 	}
+};
+
+void FpgaConfig::read_ascii(const AscFile &asc, bool nosleep)
+{
+	debug("## %s\n", __PRETTY_FUNCTION__);
+	info("Parsing ascii file..\n");
+
+	this->cram.clear();
+	this->bram.clear();
+	this->freqrange = "low";
+	this->warmboot = "enabled";
+
+	// No ".nosleep" section despite sharing the same byte as .warmboot.
+	// ".nosleep" is specified when icepack is invoked, which is too late.
+	// So we inject the section based on command line argument.
+	if (nosleep)
+		this->nosleep = "enabled";
+	else
+		this->nosleep = "disabled";
+
+	AsciiReader reader(this);
+	asc.parse(reader);
+	reader.end_comment();
 }
 
 void FpgaConfig::write_ascii(std::ostream &ofs) const
@@ -1416,11 +1446,15 @@ int main(int argc, char **argv)
 
 	std::ifstream ifs;
 	std::ofstream ofs;
+	AscFile asc;
 
-	std::istream *isp;
+	std::istream *isp = nullptr;
 	std::ostream *osp;
 
-	if (parameters.size() >= 1 && parameters[0] != "-") {
+	if (!unpack_mode) {
+		if (!asc.open(parameters.size() >= 1 ? parameters[0].c_str() : "-"))
+			error("Failed to open input file.\n");
+	} else if (parameters.size() >= 1 && parameters[0] != "-") {
 		ifs.open(parameters[0], std::ios::binary);
 		if (!ifs.is_open())
 			error("Failed to open input file.\n");
@@ -1448,7 +1482,7 @@ int main(int argc, char **argv)
 		if (!netpbm_mode)
 			fpga_config.write_ascii(*osp);
 	} else {
-		fpga_config.read_ascii(*isp, nosleep_mode);
+		fpga_config.read_ascii(asc, nosleep_mode);
 		if (!netpbm_mode)
 			fpga_config.write_bits(*osp);
 	}
@@ -20,20 +20,138 @@
 #include <string.h>
 #include <math.h>
 
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "icepll.h"
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
-const char *binstr(int v, int n)
+void print_range(double f_pllin, double f_pllout, const std::vector<pll_entry> &table, std::pair<int, int> range)
 {
-	static char buffer[16];
-	char *p = buffer;
+	for (int i = range.first; i < range.second; i++) {
+		const pll_entry &e = table[i];
+		printf("%8.3f %8.3f %10.6f %+10.1f %2d %3d %d %d\n", f_pllin, f_pllout, e.fout,
+				(e.fout - f_pllout) / f_pllout * 1e6, e.divr, e.divf, e.divq,
+				icepll_filter_range(f_pllin / (e.divr + 1)));
+	}
+}
+
+// Answer one query per line of the file ("<f_pllin> <f_pllout>", or only
+// "<f_pllout>" to use the -i frequency). Tables are built once per input
+// frequency (the last 256 are kept).
+void batch_queries(const char *filename, double default_f_pllin, bool simple_feedback, double tolerance)
+{
+	FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if (f == NULL) {
+		fprintf(stderr, "Error: Can't open '%s' for reading!\n", filename);
+		exit(1);
+	}
+
+	std::map<double, std::vector<pll_entry>> tables;
+	char line[1024];
+	int line_nr = 0;
+
+	printf("# F_PLLIN F_PLLOUT ACHIEVED ERROR(ppm) DIVR DIVF DIVQ FILTER_RANGE\n");
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line_nr++;
+
+		char *p = line + strspn(line, " \t\r\n");
+		if (*p == 0 || *p == '#')
+			continue;
+
+		double f_pllin = default_f_pllin, f_pllout;
+		int n = sscanf(p, "%lf %lf", &f_pllin, &f_pllout);
+		if (n == 1)
+			f_pllout = f_pllin, f_pllin = default_f_pllin;
+		else if (n != 2) {
+			fprintf(stderr, "Error: Invalid query in line %d of '%s'!\n", line_nr, filename);
+			exit(1);
+		}
 
-	for (int i = n-1; i >= 0; i--)
-		*(p++) = ((v >> i) & 1) ? '1' : '0';
-	*(p++) = 0;
+		if (f_pllin < 10 || f_pllin > 133) {
+			fprintf(stderr, "Error: PLL input frequency %.3f MHz in line %d is outside range 10 MHz - 133 MHz!\n", f_pllin, line_nr);
+			exit(1);
+		}
+
+		if (f_pllout < 16 || f_pllout > 275) {
+			fprintf(stderr, "Error: PLL output frequency %.3f MHz in line %d is outside range 16 MHz - 275 MHz!\n", f_pllout, line_nr);
+			exit(1);
+		}
 
-	return buffer;
+		auto it = tables.find(f_pllin);
+		if (it == tables.end() && tables.size() >= 256)
+			tables.clear();
+		if (it == tables.end())
+			it = tables.insert(std::make_pair(f_pllin, icepll_table(f_pllin, simple_feedback))).first;
+		const std::vector<pll_entry> &table = it->second;
+
+		if (tolerance >= 0) {
+			print_range(f_pllin, f_pllout, table, icepll_range(table, f_pllout, tolerance));
+		} else {
+			int idx = icepll_nearest(table, f_pllout);
+			if (idx >= 0)
+				print_range(f_pllin, f_pllout, table, std::make_pair(idx, idx+1));
+		}
+	}
+
+	if (f != stdin)
+		fclose(f);
+}
+
+void print_2f(const pll_constraints &c, const std::vector<pll_config> &solutions, int count)
+{
+	const pll_config &best = solutions.front();
+	int filter_range = icepll_filter_range(best.f_pfd);
+
+	printf("\n");
+
+	printf("F_PLLIN:    %8.3f MHz (given)\n", c.f_pllin);
+	for (int port = 0; port < 2; port++) {
+		printf("F_PLLOUT%c:  %8.3f MHz (requested)\n", 'A' + port, c.f_pllout[port]);
+		printf("F_PLLOUT%c:  %8.3f MHz (achieved)\n", 'A' + port, best.fout[port]);
+	}
+
+	printf("\n");
+
+	printf("FEEDBACK: %s\n", icepll_feedback_names[best.feedback]);
+	printf("PORTA:    %s\n", icepll_select_names[best.select[0]]);
+	printf("PORTB:    %s\n", icepll_select_names[best.select[1]]);
+	if (best.feedback == ICEPLL_FB_PHASE_AND_DELAY)
+		printf("SHIFTREG_DIV_MODE: %d (divide by %d)\n", best.sdiv == 7, best.sdiv);
+	printf("F_PFD: %8.3f MHz\n", best.f_pfd);
+	printf("F_VCO: %8.3f MHz\n", best.f_vco);
+
+	printf("\n");
+
+	printf("DIVR: %2d (4'b%s)\n", best.divr, icepll_binstr(best.divr, 4));
+	printf("DIVF: %2d (7'b%s)\n", best.divf, icepll_binstr(best.divf, 7));
+	printf("DIVQ: %2d (3'b%s)\n", best.divq, icepll_binstr(best.divq, 3));
+
+	printf("\n");
+
+	printf("FILTER_RANGE: %d (3'b%s)\n", filter_range, icepll_binstr(filter_range, 3));
+
+	printf("\n");
+
+	if (count > 1)
+	{
+		printf("%d of %d configurations:\n\n", std::min(count, (int)solutions.size()), (int)solutions.size());
+		printf("  #  FEEDBACK         PORTA           PORTB           SDIV DIVR DIVF DIVQ    F_PFD    F_VCO  F_PLLOUTA  F_PLLOUTB  ERROR(ppm)\n");
+		for (int i = 0; i < count && i < (int)solutions.size(); i++) {
+			const pll_config &s = solutions[i];
+			printf("%3d  %-16s %-15s %-15s %4d %4d %4d %4d %8.3f %8.3f %10.3f %10.3f %11.1f\n", i+1,
+					icepll_feedback_names[s.feedback], icepll_select_names[s.select[0]], icepll_select_names[s.select[1]],
+					s.feedback == ICEPLL_FB_PHASE_AND_DELAY ? s.sdiv : 0, s.divr, s.divf, s.divq,
+					s.f_pfd, s.f_vco, s.fout[0], s.fout[1], s.error * 1e6);
+		}
+		printf("\n");
+	}
 }
 
 void help(const char *cmd)
@@ -50,6 +168,37 @@ void help(const char *cmd)
 	printf("    -S\n");
 	printf("        Disable SIMPLE feedback path mode\n");
 	printf("\n");
+	printf("    -O <output_freq_mhz>\n");
+	printf("        Solve for the two outputs of SB_PLL40_2F_CORE: -o is the frequency\n");
+	printf("        of port A, -O the frequency of port B. All feedback paths (except\n");
+	printf("        SIMPLE with -S) and output selections are searched, the results\n");
+	printf("        are ranked by the larger relative error, then by F_PFD\n");
+	printf("\n");
+	printf("    -P <phase>\n");
+	printf("        Require port B to lag port A by 0 or 90 degrees (use with -O)\n");
+	printf("\n");
+	printf("    -Q <divq>\n");
+	printf("        Only consider configurations with the given DIVQ (use with -O)\n");
+	printf("\n");
+	printf("    -t <percent>\n");
+	printf("        Maximum error of each output (use with -O, default: any)\n");
+	printf("\n");
+	printf("    -k <count>\n");
+	printf("        Also list the <count> best configurations (use with -O)\n");
+	printf("\n");
+	printf("    -r <percent>\n");
+	printf("        List all configurations within +/- <percent> of the output frequency\n");
+	printf("\n");
+	printf("    -b <filename>\n");
+	printf("        Batch mode: read one query per line (\"<input_freq> <output_freq>\" or\n");
+	printf("        just \"<output_freq>\") and print the best configuration for each, or\n");
+	printf("        all configurations within the range given by -r\n");
+	printf("\n");
+	printf("    -T <filename>\n");
+	printf("        Save the table of all valid configurations for the input frequency\n");
+	printf("        (sorted by output frequency) as C header, or as JSON if the file\n");
+	printf("        name ends in .json\n");
+	printf("\n");
 	printf("    -f <filename>\n");
 	printf("        Save PLL configuration as Verilog to file\n");
 	printf("\n");
@@ -86,9 +235,17 @@ int main(int argc, char **argv)
 	char* module_name = NULL;
 	bool save_as_module = false;
 	bool quiet = false;
+	double f_pllout_b = 0;
+	int phase = -1;
+	int fixed_divq = 0;
+	double max_error = -1;
+	int count = 1;
+	double tolerance = -1;
+	char* batch_filename = NULL;
+	char* table_filename = NULL;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "i:o:Smf:n:q")) != -1)
+	while ((opt = getopt(argc, argv, "i:o:Smf:n:qO:P:Q:t:k:r:b:T:")) != -1)
 	{
 		switch (opt)
 		{
@@ -113,6 +270,30 @@ int main(int argc, char **argv)
 		case 'q':
 			quiet = true;
 			break;
+		case 'O':
+			f_pllout_b = atof(optarg);
+			break;
+		case 'P':
+			phase = atoi(optarg);
+			break;
+		case 'Q':
+			fixed_divq = atoi(optarg);
+			break;
+		case 't':
+			max_error = atof(optarg) / 100;
+			break;
+		case 'k':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			tolerance = atof(optarg) / 100;
+			break;
+		case 'b':
+			batch_filename = optarg;
+			break;
+		case 'T':
+			table_filename = optarg;
+			break;
 		default:
 			help(argv[0]);
 		}
@@ -125,87 +306,110 @@ int main(int argc, char **argv)
 	if (save_as_module && filename == NULL)
 		help(argv[0]);
 
-	bool found_something = false;
-	double best_fout = 0;
-	int best_divr = 0;
-	int best_divf = 0;
-	int best_divq = 0;
+	// error: solver options without a second output
+	if (f_pllout_b == 0 && (phase >= 0 || fixed_divq != 0 || max_error >= 0 || count != 1))
+		help(argv[0]);
+
+	// error: table options with a second output
+	if (f_pllout_b != 0 && (tolerance >= 0 || batch_filename != NULL || table_filename != NULL))
+		help(argv[0]);
+
+	if (f_pllout_b != 0)
+	{
+		if (f_pllin < 10 || f_pllin > 133) {
+			fprintf(stderr, "Error: PLL input frequency %.3f MHz is outside range 10 MHz - 133 MHz!\n", f_pllin);
+			exit(1);
+		}
+
+		if (f_pllout <= 0 || f_pllout_b <= 0) {
+			fprintf(stderr, "Error: PLL output frequencies must be positive!\n");
+			exit(1);
+		}
+
+		if (phase != -1 && phase != 0 && phase != 90) {
+			fprintf(stderr, "Error: Relative phase must be 0 or 90 degrees!\n");
+			exit(1);
+		}
+
+		if (fixed_divq < 0 || fixed_divq > 6 || count < 1) {
+			fprintf(stderr, "Error: Invalid DIVQ or configuration count!\n");
+			exit(1);
+		}
 
-	// The documentation in the iCE40 PLL Usage Guide incorrectly lists the
-	// maximum value of DIVF as 63, when it is only limited to 63 when using
-	// feedback modes other that SIMPLE.
-	int divf_max = simple_feedback ? 127 : 63;
+		pll_constraints c;
+		c.f_pllin = f_pllin;
+		c.f_pllout[0] = f_pllout;
+		c.f_pllout[1] = f_pllout_b;
+		c.allow_simple = simple_feedback;
+		c.divq = fixed_divq;
+		c.phase = phase;
+		c.max_error = max_error;
+
+		std::vector<pll_config> solutions = icepll_solve_2f(c);
+
+		if (solutions.empty()) {
+			fprintf(stderr, "Error: No valid configuration found!\n");
+			exit(1);
+		}
+
+		if (!quiet)
+			print_2f(c, solutions, count);
+
+		if (filename != NULL)
+		{
+			FILE *f = fopen(filename, "w");
+			if (f == NULL) {
+				fprintf(stderr, "Error: Can't open '%s' for writing!\n", filename);
+				exit(1);
+			}
+			icepll_write_verilog_2f(f, c, solutions.front(), save_as_module, module_name);
+			fclose(f);
+
+			printf("PLL configuration written to: %s\n", filename);
+		}
+
+		return 0;
+	}
 
 	if (f_pllin < 10 || f_pllin > 133) {
 		fprintf(stderr, "Error: PLL input frequency %.3f MHz is outside range 10 MHz - 133 MHz!\n", f_pllin);
 		exit(1);
 	}
 
-	if (f_pllout < 16 || f_pllout > 275) {
-		fprintf(stderr, "Error: PLL output frequency %.3f MHz is outside range 16 MHz - 275 MHz!\n", f_pllout);
-		exit(1);
+	if (batch_filename != NULL) {
+		batch_queries(batch_filename, f_pllin, simple_feedback, tolerance);
+		return 0;
 	}
 
-	for (int divr = 0; divr <= 15; divr++)
-	{
-		double f_pfd = f_pllin / (divr + 1);
-		if (f_pfd < 10 || f_pfd > 133) continue;
+	std::vector<pll_entry> table = icepll_table(f_pllin, simple_feedback);
 
-		for (int divf = 0; divf <= divf_max; divf++)
-		{
-			if (simple_feedback)
-			{
-				double f_vco = f_pfd * (divf + 1);
-				if (f_vco < 533 || f_vco > 1066) continue;
-
-				for (int divq = 1; divq <= 6; divq++)
-				{
-					double fout = f_vco * exp2(-divq);
-
-					if (fabs(fout - f_pllout) < fabs(best_fout - f_pllout) || !found_something) {
-						best_fout = fout;
-						best_divr = divr;
-						best_divf = divf;
-						best_divq = divq;
-						found_something = true;
-					}
-				}
-			}
-			else
-			{
-				for (int divq = 1; divq <= 6; divq++)
-				{
-					double f_vco = f_pfd * (divf + 1) * exp2(divq);
-					if (f_vco < 533 || f_vco > 1066) continue;
-
-					double fout = f_vco * exp2(-divq);
-
-					if (fabs(fout - f_pllout) < fabs(best_fout - f_pllout) || !found_something) {
-						best_fout = fout;
-						best_divr = divr;
-						best_divf = divf;
-						best_divq = divq;
-						found_something = true;
-					}
-				}
-			}
+	if (table_filename != NULL) {
+		FILE *f = fopen(table_filename, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Error: Can't open '%s' for writing!\n", table_filename);
+			exit(1);
 		}
-	}
+		int len = strlen(table_filename);
+		icepll_write_table(f, f_pllin, simple_feedback, table, len >= 5 && !strcmp(table_filename + len - 5, ".json"));
+		fclose(f);
 
-	double f_pfd = f_pllin / (best_divr + 1);;
-	double f_vco = f_pfd * (best_divf + 1);
+		printf("PLL configuration table written to: %s\n", table_filename);
+		return 0;
+	}
 
-	int filter_range =
-			f_pfd < 17 ? 1 :
-			f_pfd < 26 ? 2 :
-			f_pfd < 44 ? 3 :
-			f_pfd < 66 ? 4 :
-			f_pfd < 101 ? 5 : 6;
+	if (f_pllout < 16 || f_pllout > 275) {
+		fprintf(stderr, "Error: PLL output frequency %.3f MHz is outside range 16 MHz - 275 MHz!\n", f_pllout);
+		exit(1);
+	}
 
-	if (!simple_feedback)
-		f_vco *= exp2(best_divq);
+	if (tolerance >= 0) {
+		printf("# F_PLLIN F_PLLOUT ACHIEVED ERROR(ppm) DIVR DIVF DIVQ FILTER_RANGE\n");
+		print_range(f_pllin, f_pllout, table, icepll_range(table, f_pllout, tolerance));
+		return 0;
+	}
 
-	if (!found_something) {
+	pll_solution best;
+	if (!icepll_solve(best, f_pllin, f_pllout, simple_feedback, &table)) {
 		fprintf(stderr, "Error: No valid configuration found!\n");
 		exit(1);
 	}
@@ -216,23 +420,23 @@ int main(int argc, char **argv)
 
 		printf("F_PLLIN:  %8.3f MHz (given)\n", f_pllin);
 		printf("F_PLLOUT: %8.3f MHz (requested)\n", f_pllout);
-		printf("F_PLLOUT: %8.3f MHz (achieved)\n", best_fout);
+		printf("F_PLLOUT: %8.3f MHz (achieved)\n", best.fout);
 
 		printf("\n");
 
 		printf("FEEDBACK: %s\n", simple_feedback ? "SIMPLE" : "NON_SIMPLE");
-		printf("F_PFD: %8.3f MHz\n", f_pfd);
-		printf("F_VCO: %8.3f MHz\n", f_vco);
+		printf("F_PFD: %8.3f MHz\n", best.f_pfd);
+		printf("F_VCO: %8.3f MHz\n", best.f_vco);
 
 		printf("\n");
 
-		printf("DIVR: %2d (4'b%s)\n", best_divr, binstr(best_divr, 4));
-		printf("DIVF: %2d (7'b%s)\n", best_divf, binstr(best_divf, 7));
-		printf("DIVQ: %2d (3'b%s)\n", best_divq, binstr(best_divq, 3));
+		printf("DIVR: %2d (4'b%s)\n", best.divr, icepll_binstr(best.divr, 4));
+		printf("DIVF: %2d (7'b%s)\n", best.divf, icepll_binstr(best.divf, 7));
+		printf("DIVQ: %2d (3'b%s)\n", best.divq, icepll_binstr(best.divq, 3));
 
 		printf("\n");
 
-		printf("FILTER_RANGE: %d (3'b%s)\n", filter_range, binstr(filter_range, 3));
+		printf("FILTER_RANGE: %d (3'b%s)\n", best.filter_range, icepll_binstr(best.filter_range, 3));
 
 		printf("\n");
 	}
@@ -240,78 +444,12 @@ int main(int argc, char **argv)
 	// save PLL configuration as file
 	if (filename != NULL)
 	{
-		// open file for writing
-		FILE *f;
-		f = fopen(filename, "w");
-
-		if (save_as_module)
-		{
-			// save PLL configuration as Verilog module
-
-			// header
-			fprintf(f, "/**\n * PLL configuration\n *\n"
-						" * This Verilog module was generated automatically\n"
-						" * using the icepll tool from the IceStorm project.\n"
-						" * Use at your own risk.\n"
-						" *\n"
-						" * Given input frequency:      %8.3f MHz\n"
-						" * Requested output frequency: %8.3f MHz\n"
-						" * Achieved output frequency:  %8.3f MHz\n"
-						" */\n\n",
-						f_pllin, f_pllout, best_fout);
-
-			// generate Verilog module
-			fprintf(f,  "module %s(\n"
-						"\tinput  clock_in,\n"
-						"\toutput clock_out,\n"
-						"\toutput locked\n"
-						"\t);\n\n", (module_name ? module_name : "pll")
-					);
-
-			// save iCE40 PLL tile configuration
-			fprintf(f, "SB_PLL40_CORE #(\n");
-			fprintf(f, "\t\t.FEEDBACK_PATH(\"%s\"),\n", (simple_feedback ? "SIMPLE" : "NON_SIMPLE"));
-			fprintf(f, "\t\t.DIVR(4'b%s),\t\t"      "// DIVR = %2d\n", binstr(best_divr, 4), best_divr);
-			fprintf(f, "\t\t.DIVF(7'b%s),\t"        "// DIVF = %2d\n", binstr(best_divf, 7), best_divf);
-			fprintf(f, "\t\t.DIVQ(3'b%s),\t\t"      "// DIVQ = %2d\n", binstr(best_divq, 3), best_divq);
-			fprintf(f, "\t\t.FILTER_RANGE(3'b%s)\t" "// FILTER_RANGE = %d\n", binstr(filter_range, 3), filter_range);
-			fprintf(f, "\t) uut (\n"
-						"\t\t.LOCK(locked),\n"
-						"\t\t.RESETB(1'b1),\n"
-						"\t\t.BYPASS(1'b0),\n"
-						"\t\t.REFERENCECLK(clock_in),\n"
-						"\t\t.PLLOUTCORE(clock_out)\n"
-						"\t\t);\n\n"
-					);
-
-			fprintf(f, "endmodule\n");
+		FILE *f = fopen(filename, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Error: Can't open '%s' for writing!\n", filename);
+			exit(1);
 		}
-		else
-		{
-			// only save PLL configuration values
-
-			// header
-			fprintf(f, "/**\n * PLL configuration\n *\n"
-						" * This Verilog header file was generated automatically\n"
-						" * using the icepll tool from the IceStorm project.\n"
-						" * It is intended for use with FPGA primitives SB_PLL40_CORE,\n"
-						" * SB_PLL40_PAD, SB_PLL40_2_PAD, SB_PLL40_2F_CORE or SB_PLL40_2F_PAD.\n"
-						" * Use at your own risk.\n"
-						" *\n"
-						" * Given input frequency:      %8.3f MHz\n"
-						" * Requested output frequency: %8.3f MHz\n"
-						" * Achieved output frequency:  %8.3f MHz\n"
-						" */\n\n",
-						f_pllin, f_pllout, best_fout);
-
-			// PLL configuration
-			fprintf(f, ".FEEDBACK_PATH(\"%s\"),\n", (simple_feedback ? "SIMPLE" : "NON_SIMPLE"));
-			fprintf(f, ".DIVR(4'b%s),\t\t"      "// DIVR = %2d\n", binstr(best_divr, 4), best_divr);
-			fprintf(f, ".DIVF(7'b%s),\t"        "// DIVF = %2d\n", binstr(best_divf, 7), best_divf);
-			fprintf(f, ".DIVQ(3'b%s),\t\t"      "// DIVQ = %2d\n", binstr(best_divq, 3), best_divq);
-			fprintf(f, ".FILTER_RANGE(3'b%s)\t" "// FILTER_RANGE = %d\n", binstr(filter_range, 3), filter_range);
-		}
-
+		icepll_write_verilog(f, best, save_as_module, module_name);
 		fclose(f);
 
 		printf("PLL configuration written to: %s\n", filename);
@@ -0,0 +1,502 @@
+//
+//  icepll -- iCE40 PLL configuration solver
+//
+//  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+//
+//  Permission to use, copy, modify, and/or distribute this software for any
+//  purpose with or without fee is hereby granted, provided that the above
+//  copyright notice and this permission notice appear in all copies.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+//  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+//  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+//  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+//  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+//  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+//  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+//
+//  Usage:
+//
+//	pll_solution s;
+//	if (!icepll_solve(s, 12, 60, true))   // F_PLLIN, F_PLLOUT, SIMPLE feedback
+//		...
+//	icepll_write_verilog(stdout, s, true, "pll");
+//
+//	std::vector<pll_entry> table = icepll_table(12, true);
+//	std::pair<int, int> r = icepll_range(table, 60, 0.001);   // +/- 0.1%
+//
+//	pll_constraints c = { 12, { 100, 50 }, true, 0, -1, -1 };
+//	std::vector<pll_config> solutions = icepll_solve_2f(c);   // best first
+//
+//  All frequencies are in MHz. Nothing here prints or exits, the icepll
+//  command line tool is a thin wrapper around these functions.
+//
+
+#ifndef ICEPLL_H
+#define ICEPLL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// binary representation of the n lowest bits of v (valid until the next call)
+inline const char *icepll_binstr(int v, int n)
+{
+	static thread_local char buffer[16];
+	char *p = buffer;
+
+	for (int i = n-1; i >= 0; i--)
+		*(p++) = ((v >> i) & 1) ? '1' : '0';
+	*(p++) = 0;
+
+	return buffer;
+}
+
+// FILTER_RANGE setting for a PFD frequency
+inline int icepll_filter_range(double f_pfd)
+{
+	return	f_pfd < 17 ? 1 :
+		f_pfd < 26 ? 2 :
+		f_pfd < 44 ? 3 :
+		f_pfd < 66 ? 4 :
+		f_pfd < 101 ? 5 : 6;
+}
+
+// Table of all SB_PLL40_CORE configurations with valid PFD and VCO
+// frequencies for one input frequency and feedback mode (SIMPLE or
+// NON_SIMPLE), sorted by output frequency.
+// Entries with the same output frequency stay in search order (DIVR, DIVF,
+// DIVQ ascending), so the first one is what the exhaustive search picks.
+
+struct pll_entry
+{
+	double fout;
+	int divr, divf, divq;
+};
+
+inline std::vector<pll_entry> icepll_table(double f_pllin, bool simple_feedback)
+{
+	std::vector<pll_entry> table;
+
+	// The documentation in the iCE40 PLL Usage Guide incorrectly lists the
+	// maximum value of DIVF as 63, when it is only limited to 63 when using
+	// feedback modes other that SIMPLE.
+	int divf_max = simple_feedback ? 127 : 63;
+
+	for (int divr = 0; divr <= 15; divr++)
+	{
+		double f_pfd = f_pllin / (divr + 1);
+		if (f_pfd < 10 || f_pfd > 133) continue;
+
+		for (int divf = 0; divf <= divf_max; divf++)
+		for (int divq = 1; divq <= 6; divq++)
+		{
+			double f_vco = f_pfd * (divf + 1) * (simple_feedback ? 1 : exp2(divq));
+			if (f_vco < 533 || f_vco > 1066) continue;
+
+			table.push_back(pll_entry{f_vco * exp2(-divq), divr, divf, divq});
+		}
+	}
+
+	std::stable_sort(table.begin(), table.end(),
+			[](const pll_entry &a, const pll_entry &b) { return a.fout < b.fout; });
+	return table;
+}
+
+inline bool icepll_fout_less(const pll_entry &e, double f) { return e.fout < f; }
+inline bool icepll_less_fout(double f, const pll_entry &e) { return f < e.fout; }
+
+// index of the entry closest to f_pllout (the first one in search order on
+// ties), -1 if the table is empty
+inline int icepll_nearest(const std::vector<pll_entry> &table, double f_pllout)
+{
+	if (table.empty())
+		return -1;
+
+	int hi = std::lower_bound(table.begin(), table.end(), f_pllout, icepll_fout_less) - table.begin();
+	if (hi == (int)table.size())
+		hi--;
+
+	// first entry of the run of entries with the next lower frequency
+	int lo = hi;
+	if (table[hi].fout > f_pllout && hi > 0)
+		lo = std::lower_bound(table.begin(), table.end(), table[hi-1].fout, icepll_fout_less) - table.begin();
+
+	double err_lo = fabs(table[lo].fout - f_pllout);
+	double err_hi = fabs(table[hi].fout - f_pllout);
+
+	if (err_lo != err_hi)
+		return err_lo < err_hi ? lo : hi;
+
+	auto order = [](const pll_entry &e) { return (e.divr * 128 + e.divf) * 8 + e.divq; };
+	return order(table[lo]) <= order(table[hi]) ? lo : hi;
+}
+
+// range [begin, end) of entries with an output frequency within +/- tolerance
+// (relative) of f_pllout. The limits are widened by 1 ppb so that entries
+// exactly at the edge (e.g. 100.5 MHz for 100 MHz +/- 0.5%) are not lost to
+// rounding.
+inline std::pair<int, int> icepll_range(const std::vector<pll_entry> &table, double f_pllout, double tolerance)
+{
+	double f_min = f_pllout * (1 - tolerance) * (1 - 1e-9);
+	double f_max = f_pllout * (1 + tolerance) * (1 + 1e-9);
+	int begin = std::lower_bound(table.begin(), table.end(), f_min, icepll_fout_less) - table.begin();
+	int end = std::upper_bound(table.begin(), table.end(), f_max, icepll_less_fout) - table.begin();
+	return std::make_pair(begin, std::max(begin, end));
+}
+
+// Best configuration for a single output (SB_PLL40_CORE and friends)
+
+struct pll_solution
+{
+	bool simple_feedback;
+	double f_pllin, f_pllout;  // given
+	double fout, f_pfd, f_vco; // achieved
+	int divr, divf, divq, filter_range;
+};
+
+// Returns false if the frequencies are outside the valid ranges or no
+// configuration exists. The table can be passed in to avoid rebuilding it
+// for many queries with the same input frequency.
+inline bool icepll_solve(pll_solution &s, double f_pllin, double f_pllout, bool simple_feedback,
+		const std::vector<pll_entry> *table = nullptr)
+{
+	if (f_pllin < 10 || f_pllin > 133 || f_pllout < 16 || f_pllout > 275)
+		return false;
+
+	std::vector<pll_entry> local_table;
+	if (table == nullptr) {
+		local_table = icepll_table(f_pllin, simple_feedback);
+		table = &local_table;
+	}
+
+	int best = icepll_nearest(*table, f_pllout);
+	if (best < 0)
+		return false;
+
+	const pll_entry &e = (*table)[best];
+	s.simple_feedback = simple_feedback;
+	s.f_pllin = f_pllin;
+	s.f_pllout = f_pllout;
+	s.fout = e.fout;
+	s.divr = e.divr;
+	s.divf = e.divf;
+	s.divq = e.divq;
+	s.f_pfd = f_pllin / (e.divr + 1);
+	s.f_vco = s.f_pfd * (e.divf + 1);
+	if (!simple_feedback)
+		s.f_vco *= exp2(e.divq);
+	s.filter_range = icepll_filter_range(s.f_pfd);
+	return true;
+}
+
+// Write the configuration as Verilog module (save_as_module) or as list of
+// parameters for an SB_PLL40_* instance
+inline void icepll_write_verilog(FILE *f, const pll_solution &s, bool save_as_module, const char *module_name)
+{
+	if (save_as_module)
+	{
+		// save PLL configuration as Verilog module
+
+		// header
+		fprintf(f, "/**\n * PLL configuration\n *\n"
+					" * This Verilog module was generated automatically\n"
+					" * using the icepll tool from the IceStorm project.\n"
+					" * Use at your own risk.\n"
+					" *\n"
+					" * Given input frequency:      %8.3f MHz\n"
+					" * Requested output frequency: %8.3f MHz\n"
+					" * Achieved output frequency:  %8.3f MHz\n"
+					" */\n\n",
+					s.f_pllin, s.f_pllout, s.fout);
+
+		// generate Verilog module
+		fprintf(f,  "module %s(\n"
+					"\tinput  clock_in,\n"
+					"\toutput clock_out,\n"
+					"\toutput locked\n"
+					"\t);\n\n", (module_name ? module_name : "pll")
+				);
+
+		// save iCE40 PLL tile configuration
+		fprintf(f, "SB_PLL40_CORE #(\n");
+		fprintf(f, "\t\t.FEEDBACK_PATH(\"%s\"),\n", (s.simple_feedback ? "SIMPLE" : "NON_SIMPLE"));
+		fprintf(f, "\t\t.DIVR(4'b%s),\t\t"      "// DIVR = %2d\n", icepll_binstr(s.divr, 4), s.divr);
+		fprintf(f, "\t\t.DIVF(7'b%s),\t"        "// DIVF = %2d\n", icepll_binstr(s.divf, 7), s.divf);
+		fprintf(f, "\t\t.DIVQ(3'b%s),\t\t"      "// DIVQ = %2d\n", icepll_binstr(s.divq, 3), s.divq);
+		fprintf(f, "\t\t.FILTER_RANGE(3'b%s)\t" "// FILTER_RANGE = %d\n", icepll_binstr(s.filter_range, 3), s.filter_range);
+		fprintf(f, "\t) uut (\n"
+					"\t\t.LOCK(locked),\n"
+					"\t\t.RESETB(1'b1),\n"
+					"\t\t.BYPASS(1'b0),\n"
+					"\t\t.REFERENCECLK(clock_in),\n"
+					"\t\t.PLLOUTCORE(clock_out)\n"
+					"\t\t);\n\n"
+				);
+
+		fprintf(f, "endmodule\n");
+	}
+	else
+	{
+		// only save PLL configuration values
+
+		// header
+		fprintf(f, "/**\n * PLL configuration\n *\n"
+					" * This Verilog header file was generated automatically\n"
+					" * using the icepll tool from the IceStorm project.\n"
+					" * It is intended for use with FPGA primitives SB_PLL40_CORE,\n"
+					" * SB_PLL40_PAD, SB_PLL40_2_PAD, SB_PLL40_2F_CORE or SB_PLL40_2F_PAD.\n"
+					" * Use at your own risk.\n"
+					" *\n"
+					" * Given input frequency:      %8.3f MHz\n"
+					" * Requested output frequency: %8.3f MHz\n"
+					" * Achieved output frequency:  %8.3f MHz\n"
+					" */\n\n",
+					s.f_pllin, s.f_pllout, s.fout);
+
+		// PLL configuration
+		fprintf(f, ".FEEDBACK_PATH(\"%s\"),\n", (s.simple_feedback ? "SIMPLE" : "NON_SIMPLE"));
+		fprintf(f, ".DIVR(4'b%s),\t\t"      "// DIVR = %2d\n", icepll_binstr(s.divr, 4), s.divr);
+		fprintf(f, ".DIVF(7'b%s),\t"        "// DIVF = %2d\n", icepll_binstr(s.divf, 7), s.divf);
+		fprintf(f, ".DIVQ(3'b%s),\t\t"      "// DIVQ = %2d\n", icepll_binstr(s.divq, 3), s.divq);
+		fprintf(f, ".FILTER_RANGE(3'b%s)\t" "// FILTER_RANGE = %d\n", icepll_binstr(s.filter_range, 3), s.filter_range);
+	}
+}
+
+// Write the configurations with an output frequency in the valid range as a
+// C header or as JSON
+inline void icepll_write_table(FILE *f, double f_pllin, bool simple_feedback, const std::vector<pll_entry> &all_entries, bool json)
+{
+	std::vector<pll_entry> table;
+	for (auto &e : all_entries)
+		if (e.fout >= 16 && e.fout <= 275)
+			table.push_back(e);
+
+	const char *feedback = simple_feedback ? "SIMPLE" : "NON_SIMPLE";
+
+	if (json)
+	{
+		fprintf(f, "{\n  \"f_pllin\": %.6f,\n  \"feedback\": \"%s\",\n  \"configurations\": [\n", f_pllin, feedback);
+		for (int i = 0; i < (int)table.size(); i++) {
+			const pll_entry &e = table[i];
+			fprintf(f, "    {\"f_pllout\": %.6f, \"divr\": %d, \"divf\": %d, \"divq\": %d, \"filter_range\": %d}%s\n",
+					e.fout, e.divr, e.divf, e.divq, icepll_filter_range(f_pllin / (e.divr + 1)),
+					i+1 < (int)table.size() ? "," : "");
+		}
+		fprintf(f, "  ]\n}\n");
+	}
+	else
+	{
+		fprintf(f, "/**\n * PLL configuration table\n *\n"
+					" * This C header file was generated automatically\n"
+					" * using the icepll tool from the IceStorm project.\n"
+					" * It lists all valid configurations, sorted by output frequency.\n"
+					" *\n"
+					" * Given input frequency: %8.3f MHz\n"
+					" * Feedback path:         %s\n"
+					" */\n\n", f_pllin, feedback);
+
+		fprintf(f, "static const struct {\n"
+					"\tdouble f_pllout;\n"
+					"\tint divr, divf, divq, filter_range;\n"
+					"} icepll_table[%d] = {\n", (int)table.size());
+		for (auto &e : table)
+			fprintf(f, "\t{ %.6f, %2d, %3d, %d, %d },\n", e.fout, e.divr, e.divf, e.divq,
+					icepll_filter_range(f_pllin / (e.divr + 1)));
+		fprintf(f, "};\n");
+	}
+}
+
+// Multi-output solver for SB_PLL40_2F_CORE (two output ports A and B)
+//
+// Model of the iCE40 PLL for the three internal feedback paths:
+//
+//   SIMPLE:          F_VCO = F_PFD * (DIVF+1),  F_GENCLK = F_VCO / 2^DIVQ
+//   DELAY:           F_GENCLK = F_PFD * (DIVF+1),  F_VCO = F_GENCLK * 2^DIVQ
+//   PHASE_AND_DELAY: the feedback is taken from the shift register, which
+//                    divides F_GENCLK by 4 (SHIFTREG_DIV_MODE 0) or 7 (1):
+//                    F_GENCLK = F_PFD * (DIVF+1) * SDIV,  F_VCO = F_GENCLK * 2^DIVQ
+//
+// Each port outputs F_GENCLK (GENCLK), F_GENCLK/2 (GENCLK_HALF) or one of the
+// quadrature shift register outputs F_GENCLK/SDIV (SHIFTREG_0deg and
+// SHIFTREG_90deg, PHASE_AND_DELAY only).
+
+enum { ICEPLL_FB_SIMPLE, ICEPLL_FB_DELAY, ICEPLL_FB_PHASE_AND_DELAY };
+static const char *const icepll_feedback_names[] = { "SIMPLE", "DELAY", "PHASE_AND_DELAY" };
+
+enum { ICEPLL_SEL_GENCLK, ICEPLL_SEL_GENCLK_HALF, ICEPLL_SEL_SHIFTREG_90, ICEPLL_SEL_SHIFTREG_0 };
+static const char *const icepll_select_names[] = { "GENCLK", "GENCLK_HALF", "SHIFTREG_90deg", "SHIFTREG_0deg" };
+
+struct pll_config
+{
+	int feedback;
+	int divr, divf, divq;
+	int sdiv;
+	int select[2];
+	double f_pfd, f_vco, f_genclk;
+	double fout[2];
+	double error;
+};
+
+struct pll_constraints
+{
+	double f_pllin;
+	double f_pllout[2];
+	bool allow_simple;
+	int divq;        // 0 = any
+	int phase;       // relative phase of port B to port A in degrees, -1 = any
+	double max_error; // relative, < 0 = any
+};
+
+inline int icepll_select_phase(int sel)
+{
+	return sel == ICEPLL_SEL_SHIFTREG_90 ? 90 : 0;
+}
+
+// rank by error first, then prefer a higher PFD frequency (less jitter
+// multiplied up by the loop)
+inline bool icepll_better(const pll_config &a, const pll_config &b)
+{
+	if (fabs(a.error - b.error) > 1e-12)
+		return a.error < b.error;
+	return a.f_pfd > b.f_pfd;
+}
+
+inline std::vector<pll_config> icepll_solve_2f(const pll_constraints &c)
+{
+	std::vector<pll_config> solutions;
+
+	for (int feedback = ICEPLL_FB_SIMPLE; feedback <= ICEPLL_FB_PHASE_AND_DELAY; feedback++)
+	{
+		if (feedback == ICEPLL_FB_SIMPLE && !c.allow_simple)
+			continue;
+
+		int divf_max = feedback == ICEPLL_FB_SIMPLE ? 127 : 63;
+
+		for (int divr = 0; divr <= 15; divr++)
+		{
+			double f_pfd = c.f_pllin / (divr + 1);
+			if (f_pfd < 10 || f_pfd > 133) continue;
+
+			for (int divf = 0; divf <= divf_max; divf++)
+			for (int divq = 1; divq <= 6; divq++)
+			for (int sdiv = 4; sdiv <= (feedback == ICEPLL_FB_PHASE_AND_DELAY ? 7 : 4); sdiv += 3)
+			{
+				if (c.divq != 0 && divq != c.divq) continue;
+
+				pll_config cfg;
+				cfg.feedback = feedback;
+				cfg.divr = divr;
+				cfg.divf = divf;
+				cfg.divq = divq;
+				cfg.sdiv = sdiv;
+				cfg.f_pfd = f_pfd;
+
+				if (feedback == ICEPLL_FB_SIMPLE) {
+					cfg.f_vco = f_pfd * (divf + 1);
+					cfg.f_genclk = cfg.f_vco * exp2(-divq);
+				} else {
+					cfg.f_genclk = f_pfd * (divf + 1) * (feedback == ICEPLL_FB_PHASE_AND_DELAY ? sdiv : 1);
+					cfg.f_vco = cfg.f_genclk * exp2(divq);
+				}
+
+				if (cfg.f_vco < 533 || cfg.f_vco > 1066) continue;
+				if (cfg.f_genclk < 16 || cfg.f_genclk > 275) continue;
+
+				int max_select = feedback == ICEPLL_FB_PHASE_AND_DELAY ? ICEPLL_SEL_SHIFTREG_0 : ICEPLL_SEL_GENCLK_HALF;
+
+				for (int sel_a = ICEPLL_SEL_GENCLK; sel_a <= max_select; sel_a++)
+				for (int sel_b = ICEPLL_SEL_GENCLK; sel_b <= max_select; sel_b++)
+				{
+					if (c.phase >= 0 && (icepll_select_phase(sel_b) - icepll_select_phase(sel_a) + 360) % 360 != c.phase)
+						continue;
+
+					cfg.select[0] = sel_a;
+					cfg.select[1] = sel_b;
+					cfg.error = 0;
+
+					for (int port = 0; port < 2; port++) {
+						int sel = cfg.select[port];
+						cfg.fout[port] = sel == ICEPLL_SEL_GENCLK ? cfg.f_genclk :
+								sel == ICEPLL_SEL_GENCLK_HALF ? cfg.f_genclk / 2 : cfg.f_genclk / sdiv;
+						cfg.error = std::max(cfg.error, fabs(cfg.fout[port] - c.f_pllout[port]) / c.f_pllout[port]);
+					}
+
+					if (c.max_error >= 0 && cfg.error > c.max_error)
+						continue;
+
+					solutions.push_back(cfg);
+				}
+			}
+		}
+	}
+
+	std::stable_sort(solutions.begin(), solutions.end(), icepll_better);
+	return solutions;
+}
+
+// Write the best two-output configuration as Verilog module or parameter list
+inline void icepll_write_verilog_2f(FILE *f, const pll_constraints &c, const pll_config &best, bool save_as_module, const char *module_name)
+{
+	int filter_range = icepll_filter_range(best.f_pfd);
+	const char *prefix = save_as_module ? "\t\t" : "";
+
+	fprintf(f, "/**\n * PLL configuration\n *\n"
+				" * This Verilog %s was generated automatically\n"
+				" * using the icepll tool from the IceStorm project.\n"
+				" * It is intended for use with FPGA primitives SB_PLL40_2F_CORE\n"
+				" * or SB_PLL40_2F_PAD.\n"
+				" * Use at your own risk.\n"
+				" *\n"
+				" * Given input frequency:        %8.3f MHz\n"
+				" * Requested output frequency A: %8.3f MHz\n"
+				" * Achieved output frequency A:  %8.3f MHz\n"
+				" * Requested output frequency B: %8.3f MHz\n"
+				" * Achieved output frequency B:  %8.3f MHz\n"
+				" */\n\n", save_as_module ? "module" : "header file",
+				c.f_pllin, c.f_pllout[0], best.fout[0], c.f_pllout[1], best.fout[1]);
+
+	if (save_as_module)
+	{
+		fprintf(f,  "module %s(\n"
+					"\tinput  clock_in,\n"
+					"\toutput clock_out_a,\n"
+					"\toutput clock_out_b,\n"
+					"\toutput locked\n"
+					"\t);\n\n", (module_name ? module_name : "pll")
+				);
+
+		fprintf(f, "SB_PLL40_2F_CORE #(\n");
+	}
+
+	fprintf(f, "%s.FEEDBACK_PATH(\"%s\"),\n", prefix, icepll_feedback_names[best.feedback]);
+	fprintf(f, "%s.PLLOUT_SELECT_PORTA(\"%s\"),\n", prefix, icepll_select_names[best.select[0]]);
+	fprintf(f, "%s.PLLOUT_SELECT_PORTB(\"%s\"),\n", prefix, icepll_select_names[best.select[1]]);
+	if (best.feedback == ICEPLL_FB_PHASE_AND_DELAY)
+		fprintf(f, "%s.SHIFTREG_DIV_MODE(1'b%d),\t"  "// divide by %d\n", prefix, best.sdiv == 7, best.sdiv);
+	fprintf(f, "%s.DIVR(4'b%s),\t\t"      "// DIVR = %2d\n", prefix, icepll_binstr(best.divr, 4), best.divr);
+	fprintf(f, "%s.DIVF(7'b%s),\t"        "// DIVF = %2d\n", prefix, icepll_binstr(best.divf, 7), best.divf);
+	fprintf(f, "%s.DIVQ(3'b%s),\t\t"      "// DIVQ = %2d\n", prefix, icepll_binstr(best.divq, 3), best.divq);
+	fprintf(f, "%s.FILTER_RANGE(3'b%s)\t" "// FILTER_RANGE = %d\n", prefix, icepll_binstr(filter_range, 3), filter_range);
+
+	if (save_as_module)
+	{
+		fprintf(f, "\t) uut (\n"
+					"\t\t.LOCK(locked),\n"
+					"\t\t.RESETB(1'b1),\n"
+					"\t\t.BYPASS(1'b0),\n"
+					"\t\t.REFERENCECLK(clock_in),\n"
+					"\t\t.PLLOUTCOREA(clock_out_a),\n"
+					"\t\t.PLLOUTCOREB(clock_out_b)\n"
+					"\t\t);\n\n"
+				);
+
+		fprintf(f, "endmodule\n");
+	}
+}
+
+#endif
@@ -24,7 +24,6 @@
 
 #define _GNU_SOURCE
 
-#include <ftdi.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -35,12 +34,16 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/wait.h>
+#endif
 
-static struct ftdi_context ftdic;
-static bool ftdic_open = false;
+#include "../icecompr/iceuncompr.h"
+#include "transport.h"
+
+static const struct transport *transport = &ftdi_transport;
 static bool verbose = false;
-static bool ftdic_latency_set = false;
-static unsigned char ftdi_latency;
 
 /* MPSSE engine command definitions */
 enum mpsse_cmd
@@ -156,11 +159,116 @@ enum flash_cmd {
 	FC_RESET = 0x99, /* Reset Device */
 };
 
+/* input file, optionally compressed with icecompr (-z) */
+static FILE *input_file;
+static bool input_compressed = false;
+static struct ice_uncompr input_uncompr;
+static uint8_t input_buffer[4096];
+static const uint8_t *input_next;
+static size_t input_avail;
+static bool input_eof;
+
+static void input_rewind()
+{
+	fseek(input_file, 0, SEEK_SET);
+	ice_uncompr_init(&input_uncompr);
+	input_avail = 0;
+	input_eof = false;
+}
+
+/* read up to n bytes of uncompressed data, returns 0 at the end of the
+   file and -1 if the compressed data is corrupt */
+static int input_read(uint8_t *data, int n)
+{
+	if (!input_compressed)
+		return fread(data, 1, n, input_file);
+
+	uint8_t *out = data;
+	size_t out_avail = n;
+
+	while (out_avail > 0) {
+		if (input_avail == 0 && !input_eof) {
+			input_next = input_buffer;
+			input_avail = fread(input_buffer, 1, sizeof(input_buffer), input_file);
+			input_eof = input_avail == 0;
+		}
+
+		int rc = ice_uncompr_run(&input_uncompr, &input_next, &input_avail, &out, &out_avail);
+
+		if (rc == ICE_UNCOMPR_DONE)
+			break;
+
+		if (rc == ICE_UNCOMPR_ERROR) {
+			fprintf(stderr, "Input file is not a valid icecompr file.\n");
+			return -1;
+		}
+
+		if (input_eof && input_avail == 0 && out_avail > 0) {
+			fprintf(stderr, "Unexpected end of compressed input file.\n");
+			return -1;
+		}
+	}
+
+	return out - data;
+}
+
+/* ranges from a sector map written by icemulti -m (-M): only these parts
+   of the input file are erased, programmed and verified */
+struct sector_range {
+	int addr, len;
+};
+
+static bool use_sector_map = false;
+static struct sector_range *sector_map = NULL;
+static int sector_map_count = 0;
+static uint8_t *input_data = NULL;
+
+static bool read_sector_map(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "can't open sector map '%s': ", filename);
+		perror(0);
+		return false;
+	}
+
+	char line[256];
+	for (int line_nr = 1; fgets(line, sizeof(line), f) != NULL; line_nr++) {
+		char *p = line, *end;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+
+		long addr = strtol(p, &end, 0);
+		long len = end != p ? strtol(p = end, &end, 0) : 0;
+
+		if (end == p || addr < 0 || len <= 0 || addr % 4096 != 0) {
+			fprintf(stderr, "%s:%d: invalid sector map entry\n", filename, line_nr);
+			fclose(f);
+			return false;
+		}
+
+		sector_map = realloc(sector_map, (sector_map_count + 1) * sizeof(*sector_map));
+		sector_map[sector_map_count].addr = addr;
+		sector_map[sector_map_count].len = len;
+		sector_map_count++;
+	}
+
+	fclose(f);
+	return true;
+}
+
+/* MPSSE commands are collected in this buffer and sent in one USB transfer
+   when a response is needed (recv_bytes), before delays and when it is full */
+static uint8_t mpsse_buffer[16384];
+static int mpsse_buffer_len = 0;
+
 static void check_rx()
 {
 	while (1) {
 		uint8_t data;
-		int rc = ftdi_read_data(&ftdic, &data, 1);
+		int rc = transport->read(&data, 1);
 		if (rc <= 0)
 			break;
 		fprintf(stderr, "unexpected rx byte: %02X\n", data);
@@ -169,43 +277,81 @@ static void check_rx()
 
 static void error(int status)
 {
+	mpsse_buffer_len = 0;
 	check_rx();
 	fprintf(stderr, "ABORT.\n");
-	if (ftdic_open) {
-		if (ftdic_latency_set)
-			ftdi_set_latency_timer(&ftdic, ftdi_latency);
-		ftdi_usb_close(&ftdic);
-	}
-	ftdi_deinit(&ftdic);
+	transport->close(true);
 	exit(status);
 }
 
-static uint8_t recv_byte()
+static void mpsse_flush()
 {
-	uint8_t data;
-	while (1) {
-		int rc = ftdi_read_data(&ftdic, &data, 1);
+	if (mpsse_buffer_len == 0)
+		return;
+
+	int rc = transport->write(mpsse_buffer, mpsse_buffer_len);
+	if (rc != mpsse_buffer_len) {
+		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, mpsse_buffer_len);
+		error(2);
+	}
+	mpsse_buffer_len = 0;
+}
+
+static void mpsse_send(const uint8_t *data, int n)
+{
+	while (n > 0) {
+		if (mpsse_buffer_len == (int)sizeof(mpsse_buffer))
+			mpsse_flush();
+		int chunk = (int)sizeof(mpsse_buffer) - mpsse_buffer_len;
+		if (chunk > n)
+			chunk = n;
+		memcpy(mpsse_buffer + mpsse_buffer_len, data, chunk);
+		mpsse_buffer_len += chunk;
+		data += chunk;
+		n -= chunk;
+	}
+}
+
+static void mpsse_sleep(int usec)
+{
+	mpsse_flush();
+	transport->sleep(usec);
+}
+
+static void send_byte(uint8_t data)
+{
+	mpsse_send(&data, 1);
+}
+
+/* send all queued commands and wait for n bytes of response */
+static void recv_bytes(uint8_t *data, int n)
+{
+	if (mpsse_buffer_len > 0) {
+		send_byte(MC_FLUSH);
+		mpsse_flush();
+	}
+
+	while (n > 0) {
+		int rc = transport->read(data, n);
 		if (rc < 0) {
 			fprintf(stderr, "Read error.\n");
 			error(2);
 		}
-		if (rc == 1)
-			break;
-		usleep(100);
+		if (rc == 0)
+			transport->sleep(100);
+		data += rc;
+		n -= rc;
 	}
-	return data;
 }
 
-static void send_byte(uint8_t data)
+static uint8_t recv_byte()
 {
-	int rc = ftdi_write_data(&ftdic, &data, 1);
-	if (rc != 1) {
-		fprintf(stderr, "Write error (single byte, rc=%d, expected %d).\n", rc, 1);
-		error(2);
-	}
+	uint8_t data;
+	recv_bytes(&data, 1);
+	return data;
 }
 
-static void send_spi(uint8_t *data, int n)
+static void send_spi(const uint8_t *data, int n)
 {
 	if (n < 1)
 		return;
@@ -215,11 +361,7 @@ static void send_spi(uint8_t *data, int n)
 	send_byte(n - 1);
 	send_byte((n - 1) >> 8);
 
-	int rc = ftdi_write_data(&ftdic, data, n);
-	if (rc != n) {
-		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, n);
-		error(2);
-	}
+	mpsse_send(data, n);
 }
 
 static void xfer_spi(uint8_t *data, int n)
@@ -232,14 +374,42 @@ static void xfer_spi(uint8_t *data, int n)
 	send_byte(n - 1);
 	send_byte((n - 1) >> 8);
 
-	int rc = ftdi_write_data(&ftdic, data, n);
-	if (rc != n) {
-		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, n);
-		error(2);
-	}
+	mpsse_send(data, n);
+	recv_bytes(data, n);
+}
 
-	for (int i = 0; i < n; i++)
-		data[i] = recv_byte();
+/* read n bytes without driving data on MOSI. Unlike xfer_spi no payload
+   is sent along, so the transfer size is not limited by the FTDI buffers. */
+static void recv_spi(uint8_t *data, int n)
+{
+	if (n < 1)
+		return;
+
+	/* Input only, read on positive edge. */
+	send_byte(MC_DATA_IN);
+	send_byte(n - 1);
+	send_byte((n - 1) >> 8);
+
+	recv_bytes(data, n);
+}
+
+/* queue an SPI transfer whose response is collected later with recv_bytes */
+static void queue_xfer_spi(const uint8_t *data, int n)
+{
+	send_byte(MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN);
+	send_byte(n - 1);
+	send_byte((n - 1) >> 8);
+
+	mpsse_send(data, n);
+}
+
+/* clock n bytes with all signals idle (used as a delay that runs on the
+   FTDI chip without a USB round trip) */
+static void send_idle_clocks(int n)
+{
+	send_byte(MC_CLK_N8);
+	send_byte(n - 1);
+	send_byte((n - 1) >> 8);
 }
 
 static void set_gpio(int slavesel_b, int creset_b)
@@ -333,21 +503,15 @@ static void flash_64kB_sector_erase(int addr)
 	set_gpio(1, 0);
 }
 
-static void flash_prog(int addr, uint8_t *data, int n)
+static void flash_4kB_sector_erase(int addr)
 {
-	if (verbose)
-		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
+	fprintf(stderr, "erase 4kB sector at 0x%06X..\n", addr);
 
-	uint8_t command[4] = { FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[4] = { FC_SE, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
 
 	set_gpio(0, 0);
 	send_spi(command, 4);
-	send_spi(data, n);
 	set_gpio(1, 0);
-
-	if (verbose)
-		for (int i = 0; i < n; i++)
-			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
 }
 
 static void flash_read(int addr, uint8_t *data, int n)
@@ -359,8 +523,7 @@ static void flash_read(int addr, uint8_t *data, int n)
 
 	set_gpio(0, 0);
 	send_spi(command, 4);
-	memset(data, 0, n);
-	xfer_spi(data, n);
+	recv_spi(data, n);
 	set_gpio(1, 0);
 
 	if (verbose)
@@ -388,13 +551,77 @@ static void flash_wait()
 			fprintf(stderr, ".");
 			fflush(stdout);
 		}
-		usleep(1000);
+		mpsse_sleep(1000);
 	}
 
 	if (verbose)
 		fprintf(stderr, "\n");
 }
 
+/* Pipelined page programming: write enable, page program and a number of
+   status register reads separated by idle clocks are sent in a single USB
+   transfer. flash_prog_wait() then collects the status bytes, and only
+   falls back to flash_wait() when the flash was still busy after the last
+   queued read. The number of queued reads adapts to the page program time
+   of the flash. The caller can prepare the next page between the two. */
+
+#define PROG_POLL_INTERVAL 64 /* idle bytes between status reads, ~85us at 6 MHz */
+#define PROG_POLL_MAX 64
+
+static int prog_polls = 16;
+static int prog_polls_queued;
+
+static void flash_prog_queue(int addr, const uint8_t *data, int n)
+{
+	if (verbose) {
+		fprintf(stderr, "write enable..\n");
+		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
+		for (int i = 0; i < n; i++)
+			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
+	}
+
+	uint8_t write_enable[1] = { FC_WE };
+	uint8_t command[4] = { FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t status[2] = { FC_RSR1 };
+
+	set_gpio(0, 0);
+	send_spi(write_enable, 1);
+	set_gpio(1, 0);
+
+	set_gpio(0, 0);
+	send_spi(command, 4);
+	send_spi(data, n);
+	set_gpio(1, 0);
+
+	for (int i = 0; i < prog_polls; i++) {
+		send_idle_clocks(PROG_POLL_INTERVAL);
+		set_gpio(0, 0);
+		queue_xfer_spi(status, 2);
+		set_gpio(1, 0);
+	}
+
+	prog_polls_queued = prog_polls;
+	send_byte(MC_FLUSH);
+	mpsse_flush();
+}
+
+static void flash_prog_wait()
+{
+	uint8_t status[2 * PROG_POLL_MAX];
+	recv_bytes(status, 2 * prog_polls_queued);
+
+	for (int i = 0; i < prog_polls_queued; i++)
+		if ((status[2*i + 1] & 0x01) == 0) {
+			/* one spare read, so that slightly slower pages don't
+			   need the slow path */
+			prog_polls = i + 2 < PROG_POLL_MAX ? i + 2 : PROG_POLL_MAX;
+			return;
+		}
+
+	prog_polls = 2 * prog_polls_queued < PROG_POLL_MAX ? 2 * prog_polls_queued : PROG_POLL_MAX;
+	flash_wait();
+}
+
 static void flash_disable_protection()
 {
 	fprintf(stderr, "disable flash protection...\n");
@@ -420,6 +647,246 @@ static void flash_disable_protection()
 }
 
 
+/* erase the 4kB sectors covering addr .. addr+len, using 64kB erases
+   where possible */
+static void flash_erase_range(int addr, int len)
+{
+	int end_addr = (addr + len + 0xfff) & ~0xfff;
+
+	while (addr < end_addr) {
+		flash_write_enable();
+		if ((addr & 0xffff) == 0 && end_addr - addr >= 0x10000) {
+			flash_64kB_sector_erase(addr);
+			addr += 0x10000;
+		} else {
+			flash_4kB_sector_erase(addr);
+			addr += 0x1000;
+		}
+		flash_wait();
+	}
+}
+
+/* Only erase and program the 4kB sectors that differ from the new data
+   (-u). Sectors in which bits only need to change from 1 to 0 are
+   programmed without erasing them. Data outside of the new data in an
+   erased sector is written back. */
+static void flash_update(int offset, const uint8_t *data, int len)
+{
+	int begin_addr = offset & ~0xfff;
+	int end_addr = (offset + len + 0xfff) & ~0xfff;
+	int size = end_addr - begin_addr;
+	int num_sectors = size / 4096;
+
+	uint8_t *current = malloc(size);
+	uint8_t *target = malloc(size);
+	uint8_t *state = malloc(num_sectors); /* 0: unchanged, 1: program, 2: erase and program */
+
+	if (current == NULL || target == NULL || state == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		error(1);
+	}
+
+	fprintf(stderr, "reading..\n");
+	for (int addr = 0; addr < size; addr += 4096)
+		flash_read(begin_addr + addr, current + addr, 4096);
+
+	memcpy(target, current, size);
+	memcpy(target + (offset - begin_addr), data, len);
+
+	int count[3] = { 0, 0, 0 };
+	for (int i = 0; i < num_sectors; i++) {
+		state[i] = 0;
+		for (int k = i * 4096; k < (i + 1) * 4096; k++) {
+			if ((current[k] & target[k]) != target[k]) {
+				state[i] = 2;
+				break;
+			}
+			if (current[k] != target[k])
+				state[i] = 1;
+		}
+		count[state[i]]++;
+	}
+
+	fprintf(stderr, "sectors: %d unchanged, %d to program, %d to erase and program\n",
+			count[0], count[1], count[2]);
+
+	for (int i = 0; i < num_sectors; ) {
+		int addr = begin_addr + i * 4096;
+		bool whole_block = (addr & 0xffff) == 0 && i + 16 <= num_sectors;
+		for (int k = i; whole_block && k < i + 16; k++)
+			whole_block = state[k] == 2;
+
+		if (whole_block) {
+			flash_write_enable();
+			flash_64kB_sector_erase(addr);
+			flash_wait();
+			i += 16;
+		} else {
+			if (state[i] == 2) {
+				flash_write_enable();
+				flash_4kB_sector_erase(addr);
+				flash_wait();
+			}
+			i++;
+		}
+	}
+
+	fprintf(stderr, "programming..\n");
+	for (int addr = 0; addr < size; addr += 256) {
+		uint8_t *page = target + addr;
+		int sector_state = state[addr / 4096];
+		bool write = false;
+		for (int k = 0; k < 256 && !write; k++)
+			write = sector_state == 2 ? page[k] != 0xff : sector_state == 1 && page[k] != current[addr + k];
+		if (write) {
+			flash_prog_queue(begin_addr + addr, page, 256);
+			flash_prog_wait();
+		}
+	}
+
+	free(current);
+	free(target);
+	free(state);
+}
+
+/* -d can be given several times to program many devices at once: one
+   process is started per device, their messages are passed through pipes
+   and prefixed with the device string, and a summary is printed at the end */
+#define MAX_DEVICES 64
+
+static const char *devstrs[MAX_DEVICES];
+static int devstr_count = 0;
+
+/* input file shared by all devices, read only once before the processes
+   are started */
+static uint8_t *input_image = NULL;
+static long input_image_size = 0;
+
+static bool read_input_image(const char *filename)
+{
+	FILE *f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	while (true) {
+		input_image = realloc(input_image, input_image_size + 65536);
+		size_t rc = fread(input_image + input_image_size, 1, 65536, f);
+		if (rc == 0)
+			break;
+		input_image_size += rc;
+	}
+
+	bool ok = !ferror(f);
+	if (f != stdin)
+		fclose(f);
+	return ok;
+}
+
+/* returns the index of the device to program in the child processes, the
+   parent process waits for all of them and exits */
+static int start_programmers(const char *my_name)
+{
+#ifdef _WIN32
+	fprintf(stderr, "%s: programming several devices at once is not supported on this platform\n", my_name);
+	exit(EXIT_FAILURE);
+#else
+	struct pollfd fds[MAX_DEVICES];
+	pid_t pids[MAX_DEVICES];
+
+	for (int i = 0; i < devstr_count; i++) {
+		int pipefd[2];
+		if (pipe(pipefd) != 0) {
+			fprintf(stderr, "%s: can't create pipe: ", my_name);
+			perror(0);
+			exit(EXIT_FAILURE);
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			fprintf(stderr, "%s: can't start process for device %s: ", my_name, devstrs[i]);
+			perror(0);
+			exit(EXIT_FAILURE);
+		}
+
+		if (pids[i] == 0) {
+			for (int j = 0; j < i; j++)
+				close(fds[j].fd);
+			close(pipefd[0]);
+			dup2(pipefd[1], STDERR_FILENO);
+			close(pipefd[1]);
+			return i;
+		}
+
+		close(pipefd[1]);
+		fds[i].fd = pipefd[0];
+		fds[i].events = POLLIN;
+	}
+
+	/* pass on the messages line by line */
+	static char lines[MAX_DEVICES][256];
+	int line_len[MAX_DEVICES] = { 0 };
+	int running = devstr_count;
+
+	while (running > 0) {
+		if (poll(fds, devstr_count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll: ", my_name);
+			perror(0);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < devstr_count; i++) {
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+
+			char buffer[1024];
+			ssize_t rc = read(fds[i].fd, buffer, sizeof(buffer));
+			if (rc < 0 && errno == EINTR)
+				continue;
+
+			for (ssize_t k = 0; k < rc; k++) {
+				if (buffer[k] != '\n' && line_len[i] < (int)sizeof(lines[i]))
+					lines[i][line_len[i]++] = buffer[k];
+				if (buffer[k] == '\n' || line_len[i] == (int)sizeof(lines[i])) {
+					fprintf(stderr, "[%s] %.*s\n", devstrs[i], line_len[i], lines[i]);
+					line_len[i] = 0;
+				}
+			}
+
+			if (rc <= 0) {
+				if (line_len[i] > 0)
+					fprintf(stderr, "[%s] %.*s\n", devstrs[i], line_len[i], lines[i]);
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				running--;
+			}
+		}
+	}
+
+	int exit_status = 0, failed = 0;
+
+	fprintf(stderr, "\nSummary:\n");
+	for (int i = 0; i < devstr_count; i++) {
+		int wstatus, status;
+		while (waitpid(pids[i], &wstatus, 0) < 0 && errno == EINTR)
+			;
+		status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 2;
+		if (status == 0) {
+			fprintf(stderr, "  %-30s OK\n", devstrs[i]);
+		} else {
+			fprintf(stderr, "  %-30s FAILED (exit status %d)\n", devstrs[i], status);
+			if (exit_status == 0)
+				exit_status = status;
+			failed++;
+		}
+	}
+	fprintf(stderr, "%d of %d devices OK.\n", devstr_count - failed, devstr_count);
+
+	exit(exit_status);
+#endif
+}
+
 static void help(const char *progname)
 {
 	fprintf(stderr, "Simple programming tool for FTDI-based Lattice iCE programmers.\n");
@@ -427,6 +894,7 @@ static void help(const char *progname)
 	fprintf(stderr, "       %s -r|-R<bytes> <output file>\n", progname);
 	fprintf(stderr, "       %s -S <input file>\n", progname);
 	fprintf(stderr, "       %s -t\n", progname);
+	fprintf(stderr, "       %s -d <device> -d <device> ... <file> [<file> ...]\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "General options:\n");
 	fprintf(stderr, "  -d <device string>    use the specified USB device [default: i:0x0403:0x6010 or i:0x0403:0x6014]\n");
@@ -434,11 +902,19 @@ static void help(const char *progname)
 	fprintf(stderr, "                          i:<vendor>:<product>         (e.g. i:0x0403:0x6010)\n");
 	fprintf(stderr, "                          i:<vendor>:<product>:<index> (e.g. i:0x0403:0x6010:0)\n");
 	fprintf(stderr, "                          s:<vendor>:<product>:<serial-string>\n");
+	fprintf(stderr, "                          sim[:<flash image>]  (simulated programmer with\n");
+	fprintf(stderr, "                                                an iCE40 and a 4 MB flash)\n");
+	fprintf(stderr, "                          (can be given several times to program all devices\n");
+	fprintf(stderr, "                          at once, with one file for all or one per device)\n");
 	fprintf(stderr, "  -I [ABCD]             connect to the specified interface on the FTDI chip\n");
 	fprintf(stderr, "                          [default: A]\n");
 	fprintf(stderr, "  -o <offset in bytes>  start address for read/write [default: 0]\n");
 	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
 	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
+	fprintf(stderr, "  -M <sector map>       only erase, write and verify the ranges listed in\n");
+	fprintf(stderr, "                          the sector map (see icemulti -m)\n");
+	fprintf(stderr, "  -z                    input file is compressed with icecompr,\n");
+	fprintf(stderr, "                          decompress it while programming\n");
 	fprintf(stderr, "  -v                    verbose output\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Mode of operation:\n");
@@ -458,6 +934,8 @@ static void help(const char *progname)
 	fprintf(stderr, "  -b                    bulk erase entire flash before writing\n");
 	fprintf(stderr, "  -e <size in bytes>    erase flash as if we were writing that number of bytes\n");
 	fprintf(stderr, "  -n                    do not erase flash before writing\n");
+	fprintf(stderr, "  -u                    read the flash first and only erase and write the\n");
+	fprintf(stderr, "                          4kB sectors that differ from the file\n");
 	fprintf(stderr, "  -p                    disable write protection before erasing or writing\n");
 	fprintf(stderr, "                          This can be useful if flash memory appears to be\n");
 	fprintf(stderr, "                          bricked and won't respond to erasing or programming.\n");
@@ -510,9 +988,11 @@ int main(int argc, char **argv)
 	bool prog_sram = false;
 	bool test_mode = false;
 	bool disable_protect = false;
+	bool update_mode = false;
+	const char *sector_map_name = NULL;
 	const char *filename = NULL;
 	const char *devstr = NULL;
-	enum ftdi_interface ifnum = INTERFACE_A;
+	int ifnum = 0;
 
 	static struct option long_options[] = {
 		{"help", no_argument, NULL, -2},
@@ -521,20 +1001,25 @@ int main(int argc, char **argv)
 
 	int opt;
 	char *endptr;
-	while ((opt = getopt_long(argc, argv, "d:I:rR:e:o:cbnStvp", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "d:I:rR:e:o:cbnStvpzM:u", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'd':
+			if (devstr_count == MAX_DEVICES) {
+				fprintf(stderr, "%s: too many devices (at most %d)\n", my_name, MAX_DEVICES);
+				return EXIT_FAILURE;
+			}
+			devstrs[devstr_count++] = optarg;
 			devstr = optarg;
 			break;
 		case 'I':
 			if (!strcmp(optarg, "A"))
-				ifnum = INTERFACE_A;
+				ifnum = 0;
 			else if (!strcmp(optarg, "B"))
-				ifnum = INTERFACE_B;
+				ifnum = 1;
 			else if (!strcmp(optarg, "C"))
-				ifnum = INTERFACE_C;
+				ifnum = 2;
 			else if (!strcmp(optarg, "D"))
-				ifnum = INTERFACE_D;
+				ifnum = 3;
 			else {
 				fprintf(stderr, "%s: `%s' is not a valid interface (must be `A', `B', `C', or `D')\n", my_name, optarg);
 				return EXIT_FAILURE;
@@ -605,6 +1090,16 @@ int main(int argc, char **argv)
 		case 'p':
 			disable_protect = true;
 			break;
+		case 'z':
+			input_compressed = true;
+			break;
+		case 'M':
+			use_sector_map = true;
+			sector_map_name = optarg;
+			break;
+		case 'u':
+			update_mode = true;
+			break;
 		case -2:
 			help(argv[0]);
 			return EXIT_SUCCESS;
@@ -640,6 +1135,26 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (use_sector_map && (read_mode || erase_mode || prog_sram || test_mode || bulk_erase)) {
+		fprintf(stderr, "%s: option `-M' only valid in programming and check mode without `-b'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (update_mode && (read_mode || erase_mode || check_mode || prog_sram || test_mode || bulk_erase || dont_erase || use_sector_map)) {
+		fprintf(stderr, "%s: option `-u' only valid in programming mode without `-b', `-n' and `-M'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (use_sector_map && rw_offset % 4096 != 0) {
+		fprintf(stderr, "%s: option `-M' requires an offset that is a multiple of 4kB\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (input_compressed && (read_mode || erase_mode || test_mode)) {
+		fprintf(stderr, "%s: option `-z' only valid in programming, SRAM and check mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
 	if (rw_offset != 0 && prog_sram) {
 		fprintf(stderr, "%s: option `-o' not supported in SRAM mode\n", my_name);
 		return EXIT_FAILURE;
@@ -650,7 +1165,23 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (optind + 1 == argc) {
+	/* with several devices either one file is used for all of them or
+	   there is one file per device */
+	bool per_device_files = devstr_count > 1 && optind + devstr_count == argc;
+
+	if (devstr_count > 1 && read_mode && !per_device_files) {
+		fprintf(stderr, "%s: reading from several devices needs one output file per device\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (per_device_files)
+		for (int i = optind; i < argc; i++)
+			if (!strcmp(argv[i], "-")) {
+				fprintf(stderr, "%s: `-' can only be used as the file for all devices\n", my_name);
+				return EXIT_FAILURE;
+			}
+
+	if (optind + 1 == argc || per_device_files) {
 		if (test_mode) {
 			fprintf(stderr, "%s: test mode doesn't take a file name\n", my_name);
 			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
@@ -669,6 +1200,21 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (devstr_count > 1) {
+		if (!read_mode && !erase_mode && !test_mode && !per_device_files) {
+			if (!read_input_image(filename)) {
+				fprintf(stderr, "%s: can't read '%s': ", my_name, filename);
+				perror(0);
+				return EXIT_FAILURE;
+			}
+		}
+
+		int index = start_programmers(my_name);
+		devstr = devstrs[index];
+		if (per_device_files)
+			filename = argv[optind + index];
+	}
+
 	/* open input/output file in advance
 	   so we can fail before initializing the hardware */
 
@@ -687,7 +1233,14 @@ int main(int argc, char **argv)
 			return EXIT_FAILURE;
 		}
 	} else {
-		f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
+#ifndef _WIN32
+		/* the image shared by all devices (no fmemopen() on Windows, where
+		   several devices aren't supported anyway) */
+		if (input_image_size > 0)
+			f = fmemopen(input_image, input_image_size, "rb");
+		else
+#endif
+			f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
 		if (f == NULL) {
 			fprintf(stderr, "%s: can't open '%s' for reading: ", my_name, filename);
 			perror(0);
@@ -746,59 +1299,82 @@ int main(int argc, char **argv)
 				fseek(f, 0, SEEK_SET);
 			}
 		}
-	}
 
-	// ---------------------------------------------------------
-	// Initialize USB connection to FT2232H
-	// ---------------------------------------------------------
-
-	fprintf(stderr, "init..\n");
+		input_file = f;
+		input_rewind();
 
-	ftdi_init(&ftdic);
-	ftdi_set_interface(&ftdic, ifnum);
+		/* the erased range depends on the uncompressed size, this
+		   also makes sure that the compressed data is intact */
 
-	if (devstr != NULL) {
-		if (ftdi_usb_open_string(&ftdic, devstr)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (device string %s).\n", devstr);
-			error(2);
-		}
-	} else {
-		if (ftdi_usb_open(&ftdic, 0x0403, 0x6010) && ftdi_usb_open(&ftdic, 0x0403, 0x6014)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014).\n");
-			error(2);
+		if (input_compressed && file_size != -1) {
+			file_size = 0;
+			while (true) {
+				static uint8_t buffer[4096];
+				int rc = input_read(buffer, 4096);
+				if (rc < 0)
+					return EXIT_FAILURE;
+				if (rc == 0)
+					break;
+				file_size += rc;
+			}
+			input_rewind();
 		}
-	}
 
-	ftdic_open = true;
+		/* with a sector map or in update mode the input is accessed
+		   at random offsets, so keep all of it in memory */
 
-	if (ftdi_usb_reset(&ftdic)) {
-		fprintf(stderr, "Failed to reset iCE FTDI USB device.\n");
-		error(2);
-	}
+		if (use_sector_map || update_mode) {
+			if (use_sector_map && !read_sector_map(sector_map_name))
+				return EXIT_FAILURE;
 
-	if (ftdi_usb_purge_buffers(&ftdic)) {
-		fprintf(stderr, "Failed to purge buffers on iCE FTDI USB device.\n");
-		error(2);
-	}
+			file_size = 0;
+			while (true) {
+				input_data = realloc(input_data, file_size + 65536);
+				int rc = input_read(input_data + file_size, 65536);
+				if (rc < 0)
+					return EXIT_FAILURE;
+				if (rc == 0)
+					break;
+				file_size += rc;
+			}
 
-	if (ftdi_get_latency_timer(&ftdic, &ftdi_latency) < 0) {
-		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(&ftdic));
-		error(2);
-	}
+			/* verify the whole file */
+			if (update_mode && file_size > 0) {
+				sector_map = malloc(sizeof(*sector_map));
+				sector_map[0].addr = 0;
+				sector_map[0].len = file_size;
+				sector_map_count = 1;
+			}
 
-	/* 1 is the fastest polling, it means 1 kHz polling */
-	if (ftdi_set_latency_timer(&ftdic, 1) < 0) {
-		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(&ftdic));
-		error(2);
+			for (int i = 0; i < sector_map_count; i++) {
+				int end_addr = sector_map[i].addr + sector_map[i].len;
+				if (end_addr > file_size) {
+					fprintf(stderr, "%s: sector map range 0x%06X +0x%X is outside of the input file\n",
+							my_name, sector_map[i].addr, sector_map[i].len);
+					return EXIT_FAILURE;
+				}
+				/* whole 4 kB sectors are erased, so a range must cover them
+				   completely unless the file ends within the last one */
+				if (use_sector_map && end_addr % 4096 != 0 && end_addr != file_size) {
+					fprintf(stderr, "%s: sector map range 0x%06X +0x%X doesn't end at a sector boundary\n",
+							my_name, sector_map[i].addr, sector_map[i].len);
+					return EXIT_FAILURE;
+				}
+			}
+		}
 	}
 
-	ftdic_latency_set = true;
+	// ---------------------------------------------------------
+	// Initialize USB connection to FT2232H
+	// ---------------------------------------------------------
+
+	fprintf(stderr, "init..\n");
+
+	if (devstr != NULL && (!strcmp(devstr, "sim") || !strncmp(devstr, "sim:", 4)))
+		transport = &sim_transport;
 
-	/* Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode. Set all pins to output. */
-	if (ftdi_set_bitmode(&ftdic, 0xff, BITMODE_MPSSE) < 0) {
-		fprintf(stderr, "Failed to set BITMODE_MPSSE on iCE FTDI USB device.\n");
+	if (!transport->open(devstr, ifnum))
 		error(2);
-	}
 
 	// enable clock divide by 5
 	send_byte(MC_TCK_D5);
@@ -811,7 +1387,7 @@ int main(int argc, char **argv)
 	fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
 	set_gpio(1, 1);
-	usleep(100000);
+	mpsse_sleep(100000);
 
 
 	if (test_mode)
@@ -819,7 +1395,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "reset..\n");
 
 		set_gpio(1, 0);
-		usleep(250000);
+		mpsse_sleep(250000);
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
@@ -830,7 +1406,7 @@ int main(int argc, char **argv)
 		flash_power_down();
 
 		set_gpio(1, 1);
-		usleep(250000);
+		mpsse_sleep(250000);
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 	}
@@ -843,10 +1419,10 @@ int main(int argc, char **argv)
 		fprintf(stderr, "reset..\n");
 
 		set_gpio(0, 0);
-		usleep(100);
+		mpsse_sleep(100);
 
 		set_gpio(0, 1);
-		usleep(2000);
+		mpsse_sleep(2000);
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
@@ -858,8 +1434,10 @@ int main(int argc, char **argv)
 		fprintf(stderr, "programming..\n");
 		while (1) {
 			static unsigned char buffer[4096];
-			int rc = fread(buffer, 1, 4096, f);
-			if (rc <= 0)
+			int rc = input_read(buffer, 4096);
+			if (rc < 0)
+				error(1);
+			if (rc == 0)
 				break;
 			if (verbose)
 				fprintf(stderr, "sending %d bytes.\n", rc);
@@ -886,7 +1464,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "reset..\n");
 
 		set_gpio(1, 0);
-		usleep(250000);
+		mpsse_sleep(250000);
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
@@ -907,7 +1485,12 @@ int main(int argc, char **argv)
 				flash_disable_protection();
 			}
 			
-			if (!dont_erase)
+			if (update_mode)
+			{
+				fprintf(stderr, "file size: %ld\n", file_size);
+				flash_update(rw_offset, input_data, file_size);
+			}
+			else if (!dont_erase)
 			{
 				if (bulk_erase)
 				{
@@ -915,6 +1498,11 @@ int main(int argc, char **argv)
 					flash_bulk_erase();
 					flash_wait();
 				}
+				else if (use_sector_map)
+				{
+					for (int i = 0; i < sector_map_count; i++)
+						flash_erase_range(rw_offset + sector_map[i].addr, sector_map[i].len);
+				}
 				else
 				{
 					fprintf(stderr, "file size: %ld\n", file_size);
@@ -930,23 +1518,36 @@ int main(int argc, char **argv)
 				}
 			}
 
-			if (!erase_mode)
+			if (!erase_mode && !update_mode)
 			{
 				fprintf(stderr, "programming..\n");
 
-				for (int rc, addr = 0; true; addr += rc) {
-					uint8_t buffer[256];
-					int page_size = 256 - (rw_offset + addr) % 256;
-					rc = fread(buffer, 1, page_size, f);
-					if (rc <= 0)
-						break;
-					flash_write_enable();
-					flash_prog(rw_offset + addr, buffer, rc);
-					flash_wait();
+				for (int i = 0; i < sector_map_count; i++) {
+					int end_addr = sector_map[i].addr + sector_map[i].len;
+					for (int n, addr = sector_map[i].addr; addr < end_addr; addr += n) {
+						n = 256 - (rw_offset + addr) % 256;
+						if (n > end_addr - addr)
+							n = end_addr - addr;
+						flash_prog_queue(rw_offset + addr, input_data + addr, n);
+						flash_prog_wait();
+					}
+				}
+
+				/* the next page is read (and decompressed) while
+				   the flash is busy writing the current one */
+				uint8_t buffer[2][256];
+				int rc = use_sector_map ? 0 : input_read(buffer[0], 256 - rw_offset % 256);
+				for (int addr = 0, page = 0; rc != 0; page = !page) {
+					if (rc < 0)
+						error(1);
+					flash_prog_queue(rw_offset + addr, buffer[page], rc);
+					addr += rc;
+					rc = input_read(buffer[!page], 256 - (rw_offset + addr) % 256);
+					flash_prog_wait();
 				}
 
 				/* seek to the beginning for second pass */
-				fseek(f, 0, SEEK_SET);
+				input_rewind();
 			}
 		}
 
@@ -956,17 +1557,36 @@ int main(int argc, char **argv)
 
 		if (read_mode) {
 			fprintf(stderr, "reading..\n");
-			for (int addr = 0; addr < read_size; addr += 256) {
-				uint8_t buffer[256];
-				flash_read(rw_offset + addr, buffer, 256);
-				fwrite(buffer, read_size - addr > 256 ? 256 : read_size - addr, 1, f);
+			for (int addr = 0; addr < read_size; addr += 4096) {
+				static uint8_t buffer[4096];
+				int n = read_size - addr > 4096 ? 4096 : read_size - addr;
+				flash_read(rw_offset + addr, buffer, n);
+				fwrite(buffer, n, 1, f);
+			}
+		} else if (use_sector_map || update_mode) {
+			fprintf(stderr, "reading..\n");
+			for (int i = 0; i < sector_map_count; i++) {
+				int end_addr = sector_map[i].addr + sector_map[i].len;
+				for (int n, addr = sector_map[i].addr; addr < end_addr; addr += n) {
+					static uint8_t buffer_flash[4096];
+					n = end_addr - addr < 4096 ? end_addr - addr : 4096;
+					flash_read(rw_offset + addr, buffer_flash, n);
+					if (memcmp(input_data + addr, buffer_flash, n)) {
+						fprintf(stderr, "Found difference between flash and file!\n");
+						error(3);
+					}
+				}
 			}
+
+			fprintf(stderr, "VERIFY OK\n");
 		} else if (!erase_mode) {
 			fprintf(stderr, "reading..\n");
-			for (int addr = 0; true; addr += 256) {
-				uint8_t buffer_flash[256], buffer_file[256];
-				int rc = fread(buffer_file, 1, 256, f);
-				if (rc <= 0)
+			for (int addr = 0; true; addr += 4096) {
+				static uint8_t buffer_flash[4096], buffer_file[4096];
+				int rc = input_read(buffer_file, 4096);
+				if (rc < 0)
+					error(1);
+				if (rc == 0)
 					break;
 				flash_read(rw_offset + addr, buffer_flash, rc);
 				if (memcmp(buffer_file, buffer_flash, rc)) {
@@ -986,7 +1606,7 @@ int main(int argc, char **argv)
 		flash_power_down();
 
 		set_gpio(1, 1);
-		usleep(250000);
+		mpsse_sleep(250000);
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 	}
@@ -999,9 +1619,7 @@ int main(int argc, char **argv)
 	// ---------------------------------------------------------
 
 	fprintf(stderr, "Bye.\n");
-	ftdi_set_latency_timer(&ftdic, ftdi_latency);
-	ftdi_disable_bitbang(&ftdic);
-	ftdi_usb_close(&ftdic);
-	ftdi_deinit(&ftdic);
+	mpsse_flush();
+	transport->close(false);
 	return 0;
 }
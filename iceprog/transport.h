@@ -0,0 +1,55 @@
+/*
+ *  iceprog -- simple programming tool for FTDI-based Lattice iCE programmers
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A transport carries the MPSSE command stream built by iceprog to an
+   MPSSE engine and returns its responses. After open() the engine is in
+   MPSSE mode with all pins configured as outputs.
+
+   ftdi_transport talks to an FTDI chip with libftdi. sim_transport runs
+   an MPSSE engine with an SPI flash and an iCE40 (CRESET_B, CDONE and
+   SPI slave configuration) attached in-process, and keeps a model of
+   the time the same commands would take on real hardware. */
+
+struct transport {
+	/* devstr is the -d argument (NULL for the default device),
+	   ifnum the FTDI interface (0 for A .. 3 for D). Prints a message
+	   and returns false on errors. */
+	bool (*open)(const char *devstr, int ifnum);
+
+	/* after an error the device is released without restoring its
+	   mode */
+	void (*close)(bool error);
+
+	/* both return the number of bytes transferred or -1 on errors;
+	   read() returns 0 if no data is available yet */
+	int (*write)(const uint8_t *data, int n);
+	int (*read)(uint8_t *data, int n);
+
+	void (*sleep)(int usec);
+};
+
+extern const struct transport ftdi_transport;
+extern const struct transport sim_transport;
+
+#endif
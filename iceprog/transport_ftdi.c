@@ -0,0 +1,118 @@
+/*
+ *  iceprog -- simple programming tool for FTDI-based Lattice iCE programmers
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <ftdi.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+static struct ftdi_context ftdic;
+static bool ftdic_open = false;
+static bool ftdic_latency_set = false;
+static unsigned char ftdi_latency;
+
+static bool ftdi_open(const char *devstr, int ifnum)
+{
+	ftdi_init(&ftdic);
+	ftdi_set_interface(&ftdic, INTERFACE_A + ifnum);
+
+	if (devstr != NULL) {
+		if (ftdi_usb_open_string(&ftdic, devstr)) {
+			fprintf(stderr, "Can't find iCE FTDI USB device (device string %s).\n", devstr);
+			return false;
+		}
+	} else {
+		if (ftdi_usb_open(&ftdic, 0x0403, 0x6010) && ftdi_usb_open(&ftdic, 0x0403, 0x6014)) {
+			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014).\n");
+			return false;
+		}
+	}
+
+	ftdic_open = true;
+
+	if (ftdi_usb_reset(&ftdic)) {
+		fprintf(stderr, "Failed to reset iCE FTDI USB device.\n");
+		return false;
+	}
+
+	if (ftdi_usb_purge_buffers(&ftdic)) {
+		fprintf(stderr, "Failed to purge buffers on iCE FTDI USB device.\n");
+		return false;
+	}
+
+	if (ftdi_get_latency_timer(&ftdic, &ftdi_latency) < 0) {
+		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(&ftdic));
+		return false;
+	}
+
+	/* 1 is the fastest polling, it means 1 kHz polling */
+	if (ftdi_set_latency_timer(&ftdic, 1) < 0) {
+		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(&ftdic));
+		return false;
+	}
+
+	ftdic_latency_set = true;
+
+	/* Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode. Set all pins to output. */
+	if (ftdi_set_bitmode(&ftdic, 0xff, BITMODE_MPSSE) < 0) {
+		fprintf(stderr, "Failed to set BITMODE_MPSSE on iCE FTDI USB device.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void ftdi_close(bool error)
+{
+	if (ftdic_open) {
+		if (ftdic_latency_set)
+			ftdi_set_latency_timer(&ftdic, ftdi_latency);
+		if (!error)
+			ftdi_disable_bitbang(&ftdic);
+		ftdi_usb_close(&ftdic);
+	}
+	ftdi_deinit(&ftdic);
+	ftdic_open = false;
+}
+
+static int ftdi_write(const uint8_t *data, int n)
+{
+	/* older libftdi versions take a non-const buffer */
+	return ftdi_write_data(&ftdic, (unsigned char *)data, n);
+}
+
+static int ftdi_read(uint8_t *data, int n)
+{
+	return ftdi_read_data(&ftdic, data, n);
+}
+
+static void ftdi_sleep(int usec)
+{
+	usleep(usec);
+}
+
+const struct transport ftdi_transport = {
+	ftdi_open,
+	ftdi_close,
+	ftdi_write,
+	ftdi_read,
+	ftdi_sleep,
+};
@@ -0,0 +1,501 @@
+/*
+ *  iceprog -- simple programming tool for FTDI-based Lattice iCE programmers
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *  Simulated programmer (-d sim or -d sim:<flash image>)
+ *  ------------------------------------------------------
+ *
+ *  An MPSSE engine (the subset of AN_108 used by iceprog) connected to
+ *  a 4 MB W25Q32 style SPI flash and an iCE40:
+ *
+ *    ADBUS0  SCK       ADBUS4  SS_B (flash CS and iCE40 SPI_SS)
+ *    ADBUS1  MOSI      ADBUS6  CDONE
+ *    ADBUS2  MISO      ADBUS7  CRESET_B
+ *
+ *  When CRESET_B goes high with SS_B high, the iCE40 boots from the
+ *  flash: CDONE goes high if the flash contains a sync word (7E AA 99 7E)
+ *  in its first 4 kB. With SS_B low it enters SPI slave mode: all SPI
+ *  data goes to the iCE40 and CDONE goes high after a sync word and at
+ *  least 49 additional dummy clocks.
+ *
+ *  No real time passes. Instead the time the same command stream would
+ *  take is modelled: 125 us per USB transfer in each direction, the SPI
+ *  clock set with MC_SET_CLK_DIV, delays requested by iceprog, and the
+ *  flash program and erase times below. The flash is busy for that time;
+ *  commands other than Read Status Register sent while it is busy (or
+ *  write commands without Write Enable) are ignored like on a real flash
+ *  and counted. The statistics are printed when the device is closed.
+ *
+ *  With a file name, the flash contents are loaded from that file (if it
+ *  exists) and saved back when the device is closed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+
+#define SIM_FLASH_SIZE (4 * 1024 * 1024)
+
+#define SIM_USB_TRANSFER_US   125.0
+#define SIM_PAGE_PROGRAM_US   700.0
+#define SIM_ERASE_4K_US     45000.0
+#define SIM_ERASE_32K_US   120000.0
+#define SIM_ERASE_64K_US   150000.0
+#define SIM_ERASE_CHIP_US 10000000.0
+#define SIM_WRITE_SR_US     10000.0
+
+static const char *sim_filename;
+static uint8_t *sim_flash;
+
+/* modelled time and statistics */
+static double sim_time_us;
+static double sim_clock_mhz;
+static bool sim_div5;
+static long sim_writes, sim_reads, sim_ignored;
+
+/* MPSSE command stream (a command can be split across writes) and
+   responses */
+static uint8_t *sim_in;
+static int sim_in_len;
+static uint8_t *sim_out;
+static int sim_out_len, sim_out_pos, sim_out_size;
+static bool sim_out_fresh;
+
+/* pins */
+static bool sim_ss_low, sim_creset;
+
+/* flash state */
+static uint8_t sim_cmd[4 + 256];
+static int sim_cmd_len;
+static bool sim_wel, sim_power_down;
+static uint8_t sim_status;
+static double sim_busy_until;
+
+/* iCE40 state */
+static bool sim_slave_mode, sim_cdone;
+static uint32_t sim_sync_shift;
+static bool sim_sync_seen;
+static int sim_dummy_clocks;
+
+static bool sim_busy()
+{
+	return sim_time_us < sim_busy_until;
+}
+
+static void sim_clocks(double bits)
+{
+	sim_time_us += bits / sim_clock_mhz;
+	if (sim_slave_mode && sim_sync_seen) {
+		sim_dummy_clocks += bits;
+		if (sim_dummy_clocks >= 49)
+			sim_cdone = true;
+	}
+}
+
+static void sim_respond(uint8_t data)
+{
+	if (sim_out_len == sim_out_size) {
+		sim_out_size = sim_out_size ? 2 * sim_out_size : 65536;
+		sim_out = realloc(sim_out, sim_out_size);
+	}
+	sim_out[sim_out_len++] = data;
+	sim_out_fresh = true;
+}
+
+static uint32_t sim_cmd_addr()
+{
+	return (sim_cmd[1] << 16 | sim_cmd[2] << 8 | sim_cmd[3]) % SIM_FLASH_SIZE;
+}
+
+/* one byte on MOSI with SS_B low, returns MISO */
+static uint8_t sim_spi_byte(uint8_t mosi)
+{
+	if (sim_slave_mode) {
+		sim_sync_shift = sim_sync_shift << 8 | mosi;
+		if (sim_sync_shift == 0x7EAA997E)
+			sim_sync_seen = true;
+		sim_dummy_clocks = 0;
+		return 0xff;
+	}
+
+	int idx = sim_cmd_len++;
+	if (idx < 4)
+		sim_cmd[idx] = mosi;
+
+	if (sim_power_down)
+		return 0xff;
+
+	switch (sim_cmd[0]) {
+	case 0x05: /* Read Status Register 1 */
+		return idx == 0 ? 0xff : sim_status | (sim_wel ? 0x02 : 0) | (sim_busy() ? 0x01 : 0);
+	case 0x35: /* Read Status Register 2 */
+		return 0x00;
+	}
+
+	if (idx == 0 || sim_busy())
+		return 0xff;
+
+	switch (sim_cmd[0]) {
+	case 0x9F: /* Read JEDEC ID */
+		return idx == 1 ? 0xEF : idx == 2 ? 0x40 : idx == 3 ? 0x16 : 0x00;
+	case 0xAB: /* Release Power-Down, returns Device ID */
+		return idx >= 4 ? 0x15 : 0xff;
+	case 0x03: /* Read Data */
+		if (idx >= 4)
+			return sim_flash[(sim_cmd_addr() + idx - 4) % SIM_FLASH_SIZE];
+		break;
+	case 0x0B: /* Fast Read */
+		if (idx >= 5)
+			return sim_flash[(sim_cmd_addr() + idx - 5) % SIM_FLASH_SIZE];
+		break;
+	case 0x02: /* Page Program, the address wraps within the page */
+		if (idx >= 4)
+			sim_cmd[4 + (idx - 4) % 256] = mosi;
+		break;
+	}
+	return 0xff;
+}
+
+static void sim_erase(uint32_t addr, int size, double duration)
+{
+	addr &= ~(uint32_t)(size - 1);
+	memset(sim_flash + addr, 0xff, size);
+	sim_busy_until = sim_time_us + duration;
+}
+
+/* SS_B rising edge: execute the flash command */
+static void sim_spi_end()
+{
+	int len = sim_cmd_len;
+	uint8_t cmd = sim_cmd[0];
+	sim_cmd_len = 0;
+
+	if (sim_slave_mode || len == 0)
+		return;
+
+	if (sim_power_down) {
+		if (cmd == 0xAB)
+			sim_power_down = false;
+		return;
+	}
+
+	if (cmd == 0x05 || cmd == 0x35)
+		return;
+
+	if (sim_busy()) {
+		sim_ignored++;
+		return;
+	}
+
+	bool addr_cmd = cmd == 0x02 || cmd == 0x20 || cmd == 0x52 || cmd == 0xD8;
+	bool write_cmd = addr_cmd || cmd == 0xC7 || cmd == 0x60 || cmd == 0x01;
+	if (write_cmd) {
+		if (!sim_wel || (addr_cmd && len < 4)) {
+			sim_ignored++;
+			return;
+		}
+		sim_wel = false;
+	}
+
+	switch (cmd) {
+	case 0x06:
+		sim_wel = true;
+		break;
+	case 0x04:
+		sim_wel = false;
+		break;
+	case 0xB9:
+		sim_power_down = true;
+		break;
+	case 0x02: {
+		uint32_t addr = sim_cmd_addr();
+		int n = len - 4 < 256 ? len - 4 : 256;
+		for (int k = 0; k < n; k++)
+			sim_flash[(addr & ~0xffu) | ((addr + k) & 0xff)] &= sim_cmd[4 + k];
+		sim_busy_until = sim_time_us + SIM_PAGE_PROGRAM_US;
+		break;
+	}
+	case 0x20:
+		sim_erase(sim_cmd_addr(), 0x1000, SIM_ERASE_4K_US);
+		break;
+	case 0x52:
+		sim_erase(sim_cmd_addr(), 0x8000, SIM_ERASE_32K_US);
+		break;
+	case 0xD8:
+		sim_erase(sim_cmd_addr(), 0x10000, SIM_ERASE_64K_US);
+		break;
+	case 0xC7:
+	case 0x60:
+		sim_erase(0, SIM_FLASH_SIZE, SIM_ERASE_CHIP_US);
+		break;
+	case 0x01:
+		sim_status = len >= 2 ? sim_cmd[1] & 0xfc : 0;
+		sim_busy_until = sim_time_us + SIM_WRITE_SR_US;
+		break;
+	}
+}
+
+static void sim_set_pins(uint8_t value)
+{
+	bool ss_low = (value & 0x10) == 0;
+	bool creset = (value & 0x80) != 0;
+
+	if (sim_ss_low && !ss_low)
+		sim_spi_end();
+	if (!sim_ss_low && ss_low)
+		sim_cmd_len = 0;
+
+	if (!creset) {
+		sim_slave_mode = false;
+		sim_cdone = false;
+	} else if (!sim_creset) {
+		sim_slave_mode = ss_low;
+		sim_sync_shift = 0;
+		sim_sync_seen = false;
+		sim_dummy_clocks = 0;
+		if (!sim_slave_mode) {
+			sim_cdone = false;
+			for (int i = 0; i + 4 <= 4096; i++)
+				if (!memcmp(sim_flash + i, "\x7e\xaa\x99\x7e", 4))
+					sim_cdone = true;
+		}
+	}
+
+	sim_ss_low = ss_low;
+	sim_creset = creset;
+}
+
+/* execute complete commands from sim_in, returns false on errors */
+static bool sim_run()
+{
+	int pos = 0;
+
+	while (pos < sim_in_len) {
+		uint8_t *p = sim_in + pos;
+		int avail = sim_in_len - pos;
+		int len = 1;
+
+		if ((p[0] & 0x80) == 0) {
+			/* data shifting command */
+			if (p[0] & 0x40) {
+				fprintf(stderr, "sim: TMS commands are not supported (0x%02X).\n", p[0]);
+				return false;
+			}
+			bool bits = p[0] & 0x02, out = p[0] & 0x10, in = p[0] & 0x20;
+			if (avail < (bits ? 2 : 3))
+				break;
+			int n = bits ? p[1] + 1 : (p[1] | p[2] << 8) + 1;
+			len = (bits ? 2 : 3) + (out ? (bits ? 1 : n) : 0);
+			if (avail < len)
+				break;
+			if (!bits && in && out && n > 1024) {
+				/* the FT232H has 1 KB buffers, a longer full-duplex
+				   transfer can stall the chip */
+				fprintf(stderr, "sim: full-duplex transfer of %d bytes exceeds the 1 KB FTDI buffer.\n", n);
+				return false;
+			}
+			if (bits) {
+				/* only used for dummy clocks */
+				sim_clocks(n);
+				if (in)
+					sim_respond(0xff);
+			} else {
+				for (int i = 0; i < n; i++) {
+					sim_clocks(8);
+					uint8_t miso = sim_ss_low ? sim_spi_byte(out ? p[3 + i] : 0x00) : 0xff;
+					if (in)
+						sim_respond(miso);
+				}
+			}
+		} else {
+			switch (p[0]) {
+			case 0x80: /* MC_SETB_LOW */
+			case 0x82: /* MC_SETB_HIGH */
+			case 0x86: /* MC_SET_CLK_DIV */
+				len = 3;
+				break;
+			case 0x8E: /* MC_CLK_N */
+				len = 2;
+				break;
+			case 0x8F: /* MC_CLK_N8 */
+				len = 3;
+				break;
+			}
+			if (avail < len)
+				break;
+
+			switch (p[0]) {
+			case 0x80:
+				sim_set_pins(p[1]);
+				break;
+			case 0x81: /* MC_READB_LOW */
+				sim_respond((sim_cdone ? 0x40 : 0x00) | (sim_creset ? 0x80 : 0x00) | (sim_ss_low ? 0x00 : 0x10));
+				break;
+			case 0x83: /* MC_READB_HIGH */
+				sim_respond(0x00);
+				break;
+			case 0x86:
+				sim_clock_mhz = (sim_div5 ? 12.0 : 60.0) / ((1 + (p[1] | p[2] << 8)) * 2);
+				break;
+			case 0x8A: /* MC_TCK_X5 */
+				sim_div5 = false;
+				break;
+			case 0x8B: /* MC_TCK_D5 */
+				sim_div5 = true;
+				break;
+			case 0x8E:
+				sim_clocks(p[1] + 1);
+				break;
+			case 0x8F:
+				sim_clocks(8.0 * ((p[1] | p[2] << 8) + 1));
+				break;
+			case 0x82: case 0x84: case 0x85: case 0x87:
+			case 0x8C: case 0x8D: case 0x96: case 0x97:
+				break;
+			default:
+				/* like the real MPSSE engine: "bad command" response */
+				sim_respond(0xFA);
+				sim_respond(p[0]);
+				break;
+			}
+		}
+
+		pos += len;
+	}
+
+	memmove(sim_in, sim_in + pos, sim_in_len - pos);
+	sim_in_len -= pos;
+	return true;
+}
+
+static bool sim_open(const char *devstr, int ifnum)
+{
+	(void)ifnum;
+
+	sim_filename = devstr[3] == ':' && devstr[4] ? devstr + 4 : NULL;
+	sim_flash = malloc(SIM_FLASH_SIZE);
+	sim_in = malloc(3 + 65536);
+	if (sim_flash == NULL || sim_in == NULL) {
+		fprintf(stderr, "sim: out of memory.\n");
+		return false;
+	}
+	memset(sim_flash, 0xff, SIM_FLASH_SIZE);
+
+	if (sim_filename != NULL) {
+		FILE *f = fopen(sim_filename, "rb");
+		if (f != NULL) {
+			size_t n = fread(sim_flash, 1, SIM_FLASH_SIZE, f);
+			fclose(f);
+			fprintf(stderr, "sim: loaded %d bytes of flash contents from %s.\n", (int)n, sim_filename);
+		}
+	}
+
+	sim_div5 = false;
+	sim_clock_mhz = 30.0;
+	sim_time_us = 0;
+	sim_writes = sim_reads = sim_ignored = 0;
+	sim_in_len = sim_out_len = sim_out_pos = 0;
+	sim_ss_low = sim_creset = false;
+	sim_wel = sim_power_down = false;
+	sim_status = 0;
+	sim_busy_until = 0;
+	return true;
+}
+
+static void sim_close(bool error)
+{
+	(void)error;
+
+	if (sim_flash == NULL)
+		return;
+
+	fprintf(stderr, "sim: %ld USB writes, %ld USB reads, %.3f s modelled time.\n",
+			sim_writes, sim_reads, sim_time_us * 1e-6);
+	if (sim_ignored)
+		fprintf(stderr, "sim: %ld flash commands ignored (busy or not write enabled).\n", sim_ignored);
+
+	if (sim_filename != NULL) {
+		FILE *f = fopen(sim_filename, "wb");
+		if (f == NULL || fwrite(sim_flash, SIM_FLASH_SIZE, 1, f) != 1)
+			fprintf(stderr, "sim: can't write flash contents to %s.\n", sim_filename);
+		if (f != NULL)
+			fclose(f);
+	}
+
+	free(sim_flash);
+	free(sim_in);
+	free(sim_out);
+	sim_flash = sim_in = sim_out = NULL;
+	sim_out_size = 0;
+}
+
+static int sim_write(const uint8_t *data, int n)
+{
+	sim_writes++;
+	sim_time_us += SIM_USB_TRANSFER_US;
+
+	for (int done = 0; done < n; ) {
+		int chunk = 3 + 65536 - sim_in_len;
+		if (chunk > n - done)
+			chunk = n - done;
+		memcpy(sim_in + sim_in_len, data + done, chunk);
+		sim_in_len += chunk;
+		done += chunk;
+		if (!sim_run())
+			return -1;
+	}
+
+	return n;
+}
+
+static int sim_read(uint8_t *data, int n)
+{
+	if (sim_out_pos == sim_out_len)
+		return 0;
+
+	/* all responses to one write arrive in one transfer */
+	if (sim_out_fresh) {
+		sim_reads++;
+		sim_time_us += SIM_USB_TRANSFER_US;
+		sim_out_fresh = false;
+	}
+
+	if (n > sim_out_len - sim_out_pos)
+		n = sim_out_len - sim_out_pos;
+	memcpy(data, sim_out + sim_out_pos, n);
+	sim_out_pos += n;
+
+	if (sim_out_pos == sim_out_len)
+		sim_out_pos = sim_out_len = 0;
+	return n;
+}
+
+static void sim_sleep(int usec)
+{
+	sim_time_us += usec;
+}
+
+const struct transport sim_transport = {
+	sim_open,
+	sim_close,
+	sim_write,
+	sim_read,
+	sim_sleep,
+};
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+#
+# Benchmark icetime over synthetic designs (see mkbench.py) for all device
+# sizes, utilization levels and analysis modes.
+#
+# Writes one tab-separated line per run to stdout: device, utilization,
+# mode, wall time (s), peak RSS (kB) and the run time of each icetime phase
+# (s, as reported by 'icetime -s'). Phases not executed in a mode are 0.
+#
+# Usage: bench.py [-u <util>[,<util>..]] [-d <device>[,<device>..]]
+#                 [-m <mode>[,<mode>..]] [-n <repeat>]
+#
+
+import os, sys, time, getopt, subprocess
+
+devices = [ ("lp384", "384"), ("hx1k", "1k"), ("hx8k", "8k"), ("up5k", "5k") ]
+utils = [ "0.25", "0.50", "0.75" ]
+modes = [
+    ("estimate", []),
+    ("report", ["-t"]),
+    ("interior", ["-i", "-t"]),
+    ("maxspan", ["-m", "-t"]),
+    ("hold", ["-H", "-t"]),
+    ("corners", ["-H", "-x", "all", "-t"]),
+    ("netlist", ["-o", os.devnull]),
+]
+phases = [ "read_asc", "read_chipdb", "make_cells", "make_interconn", "write_netlist", "timing_analysis" ]
+repeat = 1
+
+try:
+    opts, args = getopt.getopt(sys.argv[1:], "u:d:m:n:")
+except getopt.GetoptError as e:
+    print(e, file=sys.stderr)
+    sys.exit(1)
+
+for o, a in opts:
+    if o == "-u":
+        utils = a.split(",")
+    elif o == "-d":
+        devices = [d for d in devices if d[0] in a.split(",")]
+    elif o == "-m":
+        modes = [m for m in modes if m[0] in a.split(",")]
+    elif o == "-n":
+        repeat = int(a)
+
+os.makedirs("bench", exist_ok=True)
+
+print("\t".join(["device", "util", "mode", "wall_s", "maxrss_kb"] + phases))
+
+for device, chip in devices:
+    for util in utils:
+        ascfile = "bench/%s_%s.asc" % (chip, util)
+        if not os.path.exists(ascfile):
+            subprocess.check_call(["python3", "mkbench.py", chip, util, "1", ascfile])
+
+        for mode, args in modes:
+            for i in range(repeat):
+                statsfile = "bench/%s_%s_%s.stats" % (chip, util, mode)
+                cmd = ["./icetime", "-C", "../icebox/chipdb-%s.txt" % chip, "-d", device, "-s", statsfile] + args + [ascfile]
+
+                start = time.time()
+                with open(os.devnull, "w") as devnull:
+                    p = subprocess.Popen(cmd, stdout=devnull)
+                    _, status, rusage = os.wait4(p.pid, 0)
+                wall = time.time() - start
+
+                if status != 0:
+                    print("Command failed: %s" % " ".join(cmd), file=sys.stderr)
+                    sys.exit(1)
+
+                phase_times = dict()
+                with open(statsfile, "r") as f:
+                    for line in f:
+                        name, secs = line.split()
+                        phase_times[name] = float(secs)
+
+                print("\t".join([device, util, mode, "%.3f" % wall, "%d" % rusage.ru_maxrss] +
+                                 ["%.3f" % phase_times.get(p, 0.0) for p in phases]))
+                sys.stdout.flush()
@@ -25,11 +25,14 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <set>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -38,18 +41,25 @@
 #include <emscripten.h>
 #endif
 
+#include "../common/ascparse.h"
+
 // add this number of ns as estimate for clock distribution mismatch
 #define GLOBAL_CLK_DIST_JITTER 0.1
 
-FILE *fin = nullptr, *fout = nullptr, *frpt = nullptr;
+AscFile fin;
+FILE *fout = nullptr, *frpt = nullptr;
 FILE *fjson = nullptr;
+FILE *fstats = nullptr;
 bool verbose = false;
 bool max_span_hack = false;
 bool json_firstentry = true;
 
 std::string config_device, device_type, selected_package, chipdbfile;
 std::vector<std::vector<std::string>> config_tile_type;
-std::vector<std::vector<std::vector<std::vector<bool>>>> config_bits;
+// config_bits[((tile_x * config_bits_height + tile_y) << 4) | bit_row] holds
+// the bits of one tile row, bit_col is the bit position within the word
+std::vector<uint64_t> config_bits;
+int config_bits_width = 0, config_bits_height = 0;
 std::map<std::tuple<int, int, int>, std::string> pin_pos;
 std::map<std::string, std::string> pin_names;
 std::set<std::tuple<int, int, int>> extra_bits;
@@ -57,21 +67,23 @@ std::set<std::string> io_names;
 
 std::map<int, std::string> net_symbols;
 
-bool get_config_bit(int tile_x, int tile_y, int bit_row, int bit_col)
+inline bool get_config_bit(int tile_x, int tile_y, int bit_row, int bit_col)
 {
-	if (int(config_bits.size()) < tile_x)
-		return false;
-
-	if (int(config_bits[tile_x].size()) < tile_y)
-		return false;
+	assert(tile_x < config_bits_width && tile_y < config_bits_height && bit_row < 16 && bit_col < 64);
+	return (config_bits[((tile_x * config_bits_height + tile_y) << 4) | bit_row] >> bit_col) & 1;
+}
 
-	if (int(config_bits[tile_x][tile_y].size()) < bit_row)
-		return false;
+void resize_config_bits(int width, int height)
+{
+	std::vector<uint64_t> new_config_bits(width * height * 16);
 
-	if (int(config_bits[tile_x][tile_y][bit_row].size()) < bit_col)
-		return false;
+	for (int x = 0; x < config_bits_width; x++)
+	for (int y = 0; y < config_bits_height; y++)
+		std::copy_n(&config_bits[(x * config_bits_height + y) * 16], 16, &new_config_bits[(x * height + y) * 16]);
 
-	return config_bits[tile_x][tile_y][bit_row][bit_col];
+	config_bits.swap(new_config_bits);
+	config_bits_width = width;
+	config_bits_height = height;
 }
 
 struct net_segment_t
@@ -174,6 +186,18 @@ std::string stringf(const char *fmt, ...)
 	return string;
 }
 
+std::chrono::steady_clock::time_point stats_phase_start = std::chrono::steady_clock::now();
+
+void stats_phase_done(const char *phase)
+{
+	if (fstats == nullptr)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	fprintf(fstats, "%s %.6f\n", phase, std::chrono::duration<double>(now - stats_phase_start).count());
+	stats_phase_start = now;
+}
+
 std::string tname()
 {
 	return stringf("t%d", tname_cnt++);
@@ -232,91 +256,90 @@ void read_pcf(const char *filename)
 	fclose(f);
 }
 
-void read_config()
+struct ConfigReader : AscVisitor
 {
-	constexpr size_t line_buf_size = 65536;
-	char buffer[line_buf_size];
-	int tile_x, tile_y, line_nr = -1;
+	int tile_x = -1, tile_y = -1;
 
-	while (fgets(buffer, line_buf_size, fin))
+	static const char *tile_type(const AscToken &keyword)
 	{
-		if (buffer[strlen(buffer) - 1] != '\n')
-		{
-			fprintf(stderr, "Input file contains very long lines.\n");
-			fprintf(stderr, "icetime cannot process it.\n");
-			exit(1);
-		}
+		static const char *tile_types[][2] = {
+			{ ".io_tile", "io" }, { ".logic_tile", "logic" },
+			{ ".ramb_tile", "ramb" }, { ".ramt_tile", "ramt" },
+			{ ".dsp0_tile", "dsp0" }, { ".dsp1_tile", "dsp1" },
+			{ ".dsp2_tile", "dsp2" }, { ".dsp3_tile", "dsp3" },
+			{ ".ipcon_tile", "ipcon" }
+		};
+
+		for (auto &it : tile_types)
+			if (keyword == it[0])
+				return it[1];
+		return nullptr;
+	}
+
+	void asc_statement(const AscStatement &stmt) override
+	{
+		const char *type = tile_type(stmt.keyword);
+		tile_x = -1;
 
-		if (buffer[0] == '.')
+		if (stmt.keyword == ".device" && stmt.nargs >= 1)
 		{
-			line_nr = -1;
-			const char *tok = strtok(buffer, " \t\r\n");
+			config_device = stmt.args[0].str();
+		} else
+		if (type != nullptr)
+		{
+			tile_x = stmt.int_arg(0);
+			tile_y = stmt.int_arg(1);
 
-			if (!strcmp(tok, ".device"))
-			{
-				config_device = strtok(nullptr, " \t\r\n");
-			} else
-			if (!strcmp(tok, ".io_tile") || !strcmp(tok, ".logic_tile") ||
-					!strcmp(tok, ".ramb_tile") || !strcmp(tok, ".ramt_tile") ||
-				  !strcmp(tok, ".ipcon_tile") || !strcmp(tok, ".dsp0_tile") ||
-				  !strcmp(tok, ".dsp1_tile") || !strcmp(tok, ".dsp2_tile") ||
-				  !strcmp(tok, ".dsp3_tile"))
-			{
-				line_nr = 0;
-				tile_x = atoi(strtok(nullptr, " \t\r\n"));
-				tile_y = atoi(strtok(nullptr, " \t\r\n"));
+			if (tile_x < 0 || tile_y < 0) {
+				fprintf(stderr, "Invalid tile coordinates in line %d of input file.\n", stmt.line_nr);
+				exit(1);
+			}
 
-				if (tile_x >= int(config_tile_type.size())) {
-					config_tile_type.resize(tile_x+1);
-					config_bits.resize(tile_x+1);
-				}
+			if (tile_x >= int(config_tile_type.size()))
+				config_tile_type.resize(tile_x+1);
 
-				if (tile_y >= int(config_tile_type.at(tile_x).size())) {
-					config_tile_type.at(tile_x).resize(tile_y+1);
-					config_bits.at(tile_x).resize(tile_y+1);
-				}
+			if (tile_y >= int(config_tile_type.at(tile_x).size()))
+				config_tile_type.at(tile_x).resize(tile_y+1);
 
-				if (!strcmp(tok, ".io_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "io";
-				if (!strcmp(tok, ".logic_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "logic";
-				if (!strcmp(tok, ".ramb_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "ramb";
-				if (!strcmp(tok, ".ramt_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "ramt";
-				if (!strcmp(tok, ".dsp0_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "dsp0";
-				if (!strcmp(tok, ".dsp1_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "dsp1";
-				if (!strcmp(tok, ".dsp2_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "dsp2";
-				if (!strcmp(tok, ".dsp3_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "dsp3";
-				if (!strcmp(tok, ".ipcon_tile"))
-					config_tile_type.at(tile_x).at(tile_y) = "ipcon";
-			} else
-			if (!strcmp(tok, ".extra_bit")) {
-				int b = atoi(strtok(nullptr, " \t\r\n"));
-				int x = atoi(strtok(nullptr, " \t\r\n"));
-				int y = atoi(strtok(nullptr, " \t\r\n"));
-				std::tuple<int, int, int> key(b, x, y);
-				extra_bits.insert(key);
-			} else
-			if (!strcmp(tok, ".sym")) {
-				int net = atoi(strtok(nullptr, " \t\r\n"));
-				const char *name = strtok(nullptr, " \t\r\n");
-				net_symbols[net] = name;
-			}
+			if (tile_x >= config_bits_width || tile_y >= config_bits_height)
+				resize_config_bits(std::max(tile_x+1, config_bits_width),
+						std::max(tile_y+1, config_bits_height));
+
+			config_tile_type.at(tile_x).at(tile_y) = type;
 		} else
-		if (line_nr >= 0)
-		{
-			assert(int(config_bits.at(tile_x).at(tile_y).size()) == line_nr);
-			config_bits.at(tile_x).at(tile_y).resize(line_nr+1);
-			for (int i = 0; buffer[i] == '0' || buffer[i] == '1'; i++)
-				config_bits.at(tile_x).at(tile_y).at(line_nr).push_back(buffer[i] == '1');
-			line_nr++;
+		if (stmt.keyword == ".extra_bit" && stmt.nargs >= 3) {
+			std::tuple<int, int, int> key(stmt.int_arg(0), stmt.int_arg(1), stmt.int_arg(2));
+			extra_bits.insert(key);
+		} else
+		if (stmt.keyword == ".sym" && stmt.nargs >= 2) {
+			net_symbols[stmt.int_arg(0)] = stmt.args[1].str();
 		}
 	}
+
+	void asc_data(const AscStatement &, int line_nr, const AscToken &line) override
+	{
+		if (tile_x < 0)
+			return;
+
+		if (line_nr >= 16) {
+			fprintf(stderr, "Too many config rows in tile %d %d.\n", tile_x, tile_y);
+			exit(1);
+		}
+
+		uint64_t word;
+		if (asc_bits_row(line, word) < 0) {
+			fprintf(stderr, "Too many config bits in row %d of tile %d %d.\n", line_nr, tile_x, tile_y);
+			exit(1);
+		}
+
+		config_bits[((tile_x * config_bits_height + tile_y) << 4) | line_nr] = word;
+	}
+};
+
+void read_config()
+{
+	ConfigReader reader;
+	fin.parse(reader);
 }
 
 void read_chipdb()
@@ -763,28 +786,33 @@ const std::set<std::string> &get_inports(std::string cell_type)
 
 #include "timings.inc"
 
-double get_delay(std::string cell_type, std::string in_port, std::string out_port)
+// timing corners, in the order of the min:typ:max triplets in the timing database.
+// CORNER_WORST takes the worst case over all three (the default without -x).
+enum { CORNER_MIN = 0, CORNER_TYP = 1, CORNER_MAX = 2, CORNER_WORST = 3 };
+const char *corner_names[3] = { "min", "typ", "max" };
+
+double get_delay(std::string cell_type, std::string in_port, std::string out_port, int corner = CORNER_WORST, bool min_delay = false)
 {
 	if (cell_type == "INTERCONN")
 		return 0;
 
 	if (device_type == "lp384")
-		return get_delay_lp384(cell_type, in_port, out_port);
+		return get_delay_lp384(cell_type, in_port, out_port, corner, min_delay);
 
 	if (device_type == "lp1k")
-		return get_delay_lp1k(cell_type, in_port, out_port);
+		return get_delay_lp1k(cell_type, in_port, out_port, corner, min_delay);
 
 	if (device_type == "lp8k")
-		return get_delay_lp8k(cell_type, in_port, out_port);
+		return get_delay_lp8k(cell_type, in_port, out_port, corner, min_delay);
 
 	if (device_type == "hx1k")
-		return get_delay_hx1k(cell_type, in_port, out_port);
+		return get_delay_hx1k(cell_type, in_port, out_port, corner, min_delay);
 
 	if (device_type == "hx8k")
-		return get_delay_hx8k(cell_type, in_port, out_port);
+		return get_delay_hx8k(cell_type, in_port, out_port, corner, min_delay);
 
 	if (device_type == "up5k")
-		return get_delay_up5k(cell_type, in_port, out_port);
+		return get_delay_up5k(cell_type, in_port, out_port, corner, min_delay);
 	fprintf(stderr, "No built-in timing database for '%s' devices!\n", device_type.c_str());
 	exit(1);
 }
@@ -804,9 +832,44 @@ struct TimingAnalysis
 	std::string global_max_path_net;
 	double global_max_path_delay;
 
+	// net_max_hold[<net_name>] = { <hold_time>, <cell_name>, <cell_port> }
+	std::map<std::string, std::tuple<double, std::string, std::string>> net_max_hold;
+
+	// net_min_path_parent[<net_name>] = { <parent_net>, <cell_name>, <inport>, <outport>, <delay> }
+	std::map<std::string, std::tuple<std::string, std::string, std::string, std::string, double>> net_min_path_parent;
+
+	std::map<std::string, double> net_min_path_delay;
+	std::string global_min_hold_net;
+	double global_min_hold_slack;
+
 	bool interior_timing;
+	bool hold_analysis;
+	int setup_corner, hold_corner;
 	std::set<std::string> interior_nets;
 
+	static bool is_clock_port(const std::string &port)
+	{
+		return port == "clk" || port == "RCLK" || port == "WCLK" || port == "CLK" || port == "CLOCK";
+	}
+
+	static bool is_path_arc(const std::string &driver_type, const std::string &driver_port, const std::string &inport)
+	{
+		if (inport == "clk" || inport == "INPUTCLK" || inport == "OUTPUTCLK" || inport == "PADIN")
+			return false;
+
+		if (driver_type == "LogicCell40" && driver_port == "carryout") {
+			if (inport == "in0" || inport == "in3" || inport == "ce" || inport == "sr")
+				return false;
+		}
+
+		if (driver_type == "LogicCell40" && (driver_port == "ltout" || driver_port == "lcout")) {
+			if (inport == "carryin")
+				return false;
+		}
+
+		return true;
+	}
+
 	double calc_net_max_path_delay(const std::string &net)
 	{
 		if (net_max_path_delay.count(net))
@@ -826,25 +889,15 @@ struct TimingAnalysis
 			if (interior_timing && driver_type == "PRE_IO")
 				net_max_path_delay[net] = -1e3;
 			else
-				net_max_path_delay[net] = get_delay(driver_type, "*clkedge*", driver_port) + GLOBAL_CLK_DIST_JITTER;
+				net_max_path_delay[net] = get_delay(driver_type, "*clkedge*", driver_port, setup_corner) + GLOBAL_CLK_DIST_JITTER;
 			return net_max_path_delay[net];
 		}
 
 		for (auto &inport : get_inports(driver_type))
 		{
-			if (inport == "clk" || inport == "INPUTCLK" || inport == "OUTPUTCLK" || inport == "PADIN")
+			if (!is_path_arc(driver_type, driver_port, inport))
 				continue;
 
-			if (driver_type == "LogicCell40" && driver_port == "carryout") {
-				if (inport == "in0" || inport == "in3" || inport == "ce" || inport == "sr")
-					continue;
-			}
-
-			if (driver_type == "LogicCell40" && (driver_port == "ltout" || driver_port == "lcout")) {
-				if (inport == "carryin")
-					continue;
-			}
-
 			std::string *in_net = &netlist_cell_ports.at(driver_cell).at(inport);
 			while (net_assignments.count(*in_net))
 				in_net = &net_assignments.at(*in_net);
@@ -852,7 +905,7 @@ struct TimingAnalysis
 			if (*in_net == "" || *in_net == "vcc" || *in_net == "gnd")
 				continue;
 
-			double this_cell_delay = get_delay(driver_type, inport, driver_port);
+			double this_cell_delay = get_delay(driver_type, inport, driver_port, setup_corner);
 			double this_path_delay = calc_net_max_path_delay(*in_net) + this_cell_delay;
 
 			if (this_path_delay >= max_path_delay) {
@@ -865,6 +918,55 @@ struct TimingAnalysis
 		return net_max_path_delay.at(net);
 	}
 
+	// Shortest path from a launching flip-flop. Nets that are not driven by
+	// a flip-flop (IOs, constants, loops) get a huge delay and never fail
+	// the hold check.
+	double calc_net_min_path_delay(const std::string &net)
+	{
+		if (net_min_path_delay.count(net))
+			return net_min_path_delay.at(net);
+
+		if (net_driver.count(net) == 0)
+			return 1e6;
+
+		double min_path_delay = 1e6;
+		net_min_path_delay[net] = 1e6;
+
+		auto &driver_cell = net_driver.at(net).first;
+		auto &driver_port = net_driver.at(net).second;
+		auto &driver_type = netlist_cell_types.at(driver_cell);
+
+		if (is_primary(driver_cell, driver_port)) {
+			if (driver_type != "PRE_IO")
+				net_min_path_delay[net] = get_delay(driver_type, "*clkedge*", driver_port, hold_corner, true);
+			return net_min_path_delay[net];
+		}
+
+		for (auto &inport : get_inports(driver_type))
+		{
+			if (!is_path_arc(driver_type, driver_port, inport))
+				continue;
+
+			std::string *in_net = &netlist_cell_ports.at(driver_cell).at(inport);
+			while (net_assignments.count(*in_net))
+				in_net = &net_assignments.at(*in_net);
+
+			if (*in_net == "" || *in_net == "vcc" || *in_net == "gnd")
+				continue;
+
+			double this_cell_delay = get_delay(driver_type, inport, driver_port, hold_corner, true);
+			double this_path_delay = calc_net_min_path_delay(*in_net) + this_cell_delay;
+
+			if (this_path_delay < min_path_delay) {
+				net_min_path_parent[net] = std::make_tuple(*in_net, driver_cell, inport, driver_port, this_cell_delay);
+				min_path_delay = this_path_delay;
+			}
+		}
+
+		net_min_path_delay[net] = min_path_delay;
+		return net_min_path_delay.at(net);
+	}
+
 	void mark_interior(std::string net)
 	{
 		if (net.empty())
@@ -878,7 +980,8 @@ struct TimingAnalysis
 		interior_nets.insert(net);
 	}
 
-	TimingAnalysis(bool interior_timing) : interior_timing(interior_timing)
+	TimingAnalysis(bool interior_timing, bool hold_analysis = false, int setup_corner = CORNER_WORST, int hold_corner = CORNER_WORST) :
+			interior_timing(interior_timing), hold_analysis(hold_analysis), setup_corner(setup_corner), hold_corner(hold_corner)
 	{
 		std::set<std::string> all_nets;
 
@@ -897,13 +1000,24 @@ struct TimingAnalysis
 			if (get_inports(cell_type).count(port_name)) {
 				std::string n = net_name;
 				while (1) {
-					double setup_time = get_delay(cell_type, port_name, "*setup*");
+					double setup_time = get_delay(cell_type, port_name, "*setup*", setup_corner);
 					if (setup_time >= std::get<0>(net_max_setup[n]))
 						net_max_setup[n] = std::make_tuple(setup_time, cell_name, port_name);
 					if (net_assignments.count(n) == 0)
 						break;
 					n = net_assignments.at(n);
 				}
+				if (hold_analysis && cell_type != "PRE_IO" && is_primary(cell_name, "lcout") && !is_clock_port(port_name)) {
+					std::string n = net_name;
+					while (1) {
+						double hold_time = get_delay(cell_type, port_name, "*hold*", hold_corner);
+						if (std::get<1>(net_max_hold[n]).empty() || hold_time >= std::get<0>(net_max_hold[n]))
+							net_max_hold[n] = std::make_tuple(hold_time, cell_name, port_name);
+						if (net_assignments.count(n) == 0)
+							break;
+						n = net_assignments.at(n);
+					}
+				}
 				if (interior_timing && cell_type != "PRE_IO" && is_primary(cell_name, "lcout"))
 					mark_interior(net_name);
 				continue;
@@ -924,6 +1038,19 @@ struct TimingAnalysis
 				global_max_path_net = net;
 			}
 		}
+
+		global_min_hold_slack = 1e6;
+
+		if (hold_analysis)
+			for (auto &net : all_nets) {
+				if (net_max_hold.count(net) == 0)
+					continue;
+				double slack = calc_net_min_path_delay(net) - GLOBAL_CLK_DIST_JITTER - std::get<0>(net_max_hold.at(net));
+				if (slack < global_min_hold_slack) {
+					global_min_hold_slack = slack;
+					global_min_hold_net = net;
+				}
+			}
 	}
 
 	double report(std::string n = std::string())
@@ -1076,6 +1203,8 @@ struct TimingAnalysis
 				std::string line = json_lines[i];
 				if (i == 0 && line.back() == ',')
 					line.pop_back();
+				if (setup_corner != CORNER_WORST)
+					line.insert(line.find('{') + 2, stringf("\"corner\": \"%s\", ", corner_names[setup_corner]));
 				fprintf(fjson, "%s\n", line.c_str());
 			}
 			json_firstentry = false;
@@ -1119,6 +1248,62 @@ struct TimingAnalysis
 
 		return delay;
 	}
+
+	double report_hold()
+	{
+		std::vector<std::string> rpt_lines;
+		std::set<std::string> visited_nets;
+		std::string n = global_min_hold_net;
+
+		if (n.empty()) {
+			if (frpt)
+				fprintf(frpt, "No flop-to-flop paths found for hold analysis.\n\n");
+			return global_min_hold_slack;
+		}
+
+		if (frpt) {
+			int i = fprintf(frpt, "Report for worst hold path:\n");
+			while (--i) fputc('-', frpt);
+			fprintf(frpt, "\n\n");
+		}
+
+		auto &user = net_max_hold.at(n);
+		rpt_lines.push_back(stringf("        %s (%s) %s [hold]: %.3f ns", std::get<1>(user).c_str(),
+				netlist_cell_types.at(std::get<1>(user)).c_str(), std::get<2>(user).c_str(), std::get<0>(user)));
+
+		while (1)
+		{
+			rpt_lines.push_back(stringf("%10.3f ns %s", calc_net_min_path_delay(n), n.c_str()));
+
+			if (net_min_path_parent.count(n) == 0 || visited_nets.count(n)) {
+				auto &driver_cell = net_driver.at(n).first;
+				rpt_lines.push_back(stringf("        %s (%s) [clk] -> %s: %.3f ns", driver_cell.c_str(),
+						netlist_cell_types.at(driver_cell).c_str(), net_driver.at(n).second.c_str(), calc_net_min_path_delay(n)));
+				break;
+			}
+
+			auto &entry = net_min_path_parent.at(n);
+			rpt_lines.push_back(stringf("        %s (%s) %s -> %s: %.3f ns", std::get<1>(entry).c_str(),
+					netlist_cell_types.at(std::get<1>(entry)).c_str(), std::get<2>(entry).c_str(),
+					std::get<3>(entry).c_str(), std::get<4>(entry)));
+
+			visited_nets.insert(n);
+			n = std::get<0>(entry);
+		}
+
+		if (frpt)
+		{
+			for (int i = int(rpt_lines.size())-1; i >= 0; i--)
+				fprintf(frpt, "%s\n", rpt_lines[i].c_str());
+
+			fprintf(frpt, "\n");
+			fprintf(frpt, "Clock distribution mismatch: %.3f ns\n", GLOBAL_CLK_DIST_JITTER);
+			fprintf(frpt, "Worst hold slack: %.2f ns\n", global_min_hold_slack);
+			fprintf(frpt, "\n");
+		}
+
+		return global_min_hold_slack;
+	}
 };
 
 void register_interconn_src(int x, int y, int net)
@@ -1315,7 +1500,7 @@ std::string ecnetname_to_vlog(std::string ec_name)
 		} else {
 			return ec_name;
 		}
-	} catch(std::invalid_argument e) { // Not numeric and stoi throws exception
+	} catch(std::invalid_argument &e) { // Not numeric and stoi throws exception
 		return ec_name;
 	}
 
@@ -2236,8 +2421,21 @@ void help(const char *cmd)
 	printf("    -N\n");
 	printf("        list valid net names for -T <net_name>\n");
 	printf("\n");
+	printf("    -x min|typ|max|all\n");
+	printf("        select the timing corner (default: worst case over all\n");
+	printf("        corners). 'all' analyses all corners on the same timing\n");
+	printf("        netlist, -j then adds a \"corner\" field to each entry.\n");
+	printf("\n");
+	printf("    -H\n");
+	printf("        also perform hold time (min-delay) analysis on all\n");
+	printf("        flop-to-flop paths and report the worst hold slack\n");
+	printf("\n");
 	printf("    -c <Mhz>\n");
 	printf("        check timing estimate against clock constraint\n");
+	printf("        (and hold slack against zero when used with -H)\n");
+	printf("\n");
+	printf("    -s <output_file>\n");
+	printf("        write run time of each phase (in seconds) to the file\n");
 	printf("\n");
 	printf("    -v\n");
 	printf("        verbose mode (print all interconnect trees)\n");
@@ -2262,11 +2460,13 @@ int main(int argc, char **argv)
 	bool listnets = false;
 	bool print_timing = false;
 	bool interior_timing = false;
+	bool hold_analysis = false;
+	std::vector<int> timing_corners;
 	double clock_constr = 0;
 	std::vector<std::string> print_timing_nets;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "p:P:g:o:r:j:d:mitT:Nvc:C:")) != -1)
+	while ((opt = getopt(argc, argv, "p:P:g:o:r:j:s:d:mitHx:T:Nvc:C:")) != -1)
 	{
 		switch (opt)
 		{
@@ -2306,6 +2506,13 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 's':
+			fstats = fopen(optarg, "w");
+			if (fstats == nullptr) {
+				perror("Can't open stats file");
+				exit(1);
+			}
+			break;
 		case 'd':
 			device_type = optarg;
 			break;
@@ -2318,6 +2525,23 @@ int main(int argc, char **argv)
 		case 't':
 			print_timing = true;
 			break;
+		case 'H':
+			hold_analysis = true;
+			break;
+		case 'x':
+			if (!strcmp(optarg, "all")) {
+				timing_corners = { CORNER_MIN, CORNER_TYP, CORNER_MAX };
+			} else {
+				int corner = 0;
+				while (corner < 3 && strcmp(optarg, corner_names[corner]))
+					corner++;
+				if (corner == 3) {
+					fprintf(stderr, "Error: Invalid timing corner '%s'.\n", optarg);
+					exit(1);
+				}
+				timing_corners = { corner };
+			}
+			break;
 		case 'T':
 			print_timing_nets.push_back(optarg);
 			break;
@@ -2339,8 +2563,7 @@ int main(int argc, char **argv)
 	}
 
 	if (optind+1 == argc) {
-		fin = fopen(argv[optind], "r");
-		if (fin == nullptr) {
+		if (!fin.open(argv[optind])) {
 			perror("Can't open input file");
 			exit(1);
 		}
@@ -2349,7 +2572,9 @@ int main(int argc, char **argv)
 
 	printf("// Reading input .asc file..\n");
 	fflush(stdout);
+	stats_phase_start = std::chrono::steady_clock::now();
 	read_config();
+	stats_phase_done("read_asc");
 
 	std::transform(config_device.begin(), config_device.end(), config_device.begin(), ::tolower);
 
@@ -2392,6 +2617,7 @@ device_chip_mismatch:
 	printf("// Reading %s chipdb file..\n", config_device.c_str());
 	fflush(stdout);
 	read_chipdb();
+	stats_phase_done("read_chipdb");
 
 	printf("// Creating timing netlist..\n");
 	fflush(stdout);
@@ -2478,6 +2704,8 @@ device_chip_mismatch:
 		}
 	}
 
+	stats_phase_done("make_cells");
+
 	FILE *graph_f = nullptr;
 
 	if (!graph_nets.empty())
@@ -2510,6 +2738,8 @@ device_chip_mismatch:
 			extra_wires.insert(port.second);
 		}
 
+	stats_phase_done("make_interconn");
+
 	if (fout != NULL)
 	{
 		fprintf(fout, "module chip (");
@@ -2587,49 +2817,86 @@ device_chip_mismatch:
 		}
 
 		fprintf(fout, "endmodule\n");
+		stats_phase_done("write_netlist");
 	}
 
 	double max_path_delay = 0;
+	double min_hold_slack = 1e6;
 
 	if (fjson)
 		fprintf(fjson, "[\n");
 
-	if (print_timing || listnets || !print_timing_nets.empty())
-	{
-		TimingAnalysis ta(interior_timing);
+	bool print_report = print_timing || listnets || !print_timing_nets.empty();
+	bool print_estimate = !print_report || frpt != nullptr;
 
-		if (frpt == nullptr)
-			frpt = stdout;
-		else
-			printf("// Timing estimate: %.2f ns (%.2f MHz)\n", ta.global_max_path_delay, 1000.0 / ta.global_max_path_delay);
+	if (print_report && frpt == nullptr)
+		frpt = stdout;
 
-		fprintf(frpt, "\n");
-		fprintf(frpt, "icetime topological timing analysis report\n");
-		fprintf(frpt, "==========================================\n");
-		fprintf(frpt, "\n");
+	// without -x: worst case over all corners, for setup and hold analysis
+	if (timing_corners.empty())
+		timing_corners.push_back(CORNER_WORST);
 
-		if (max_span_hack) {
-			fprintf(frpt, "Info: max_span_hack is enabled: estimate is conservative.\n");
-			fprintf(frpt, "\n");
+	for (int corner : timing_corners)
+	{
+		std::string corner_info = corner == CORNER_WORST ? "" : stringf(" (%s corner)", corner_names[corner]);
+		TimingAnalysis ta(interior_timing, hold_analysis, corner, corner);
+
+		if (print_estimate) {
+			printf("// Timing estimate%s: %.2f ns (%.2f MHz)\n", corner_info.c_str(), ta.global_max_path_delay, 1000.0 / ta.global_max_path_delay);
+			if (hold_analysis && !ta.global_min_hold_net.empty())
+				printf("// Hold slack estimate%s: %.2f ns\n", corner_info.c_str(), ta.global_min_hold_slack);
 		}
 
-		for (auto &n : print_timing_nets)
-			max_path_delay = std::max(max_path_delay, ta.report(n));
+		if (print_report)
+		{
+			fprintf(frpt, "\n");
+			fprintf(frpt, "icetime topological timing analysis report\n");
+			fprintf(frpt, "==========================================\n");
+			fprintf(frpt, "\n");
+
+			if (corner != CORNER_WORST) {
+				fprintf(frpt, "Info: timing corner is '%s'.\n", corner_names[corner]);
+				fprintf(frpt, "\n");
+			}
+
+			if (max_span_hack) {
+				fprintf(frpt, "Info: max_span_hack is enabled: estimate is conservative.\n");
+				fprintf(frpt, "\n");
+			}
+
+			for (auto &n : print_timing_nets)
+				max_path_delay = std::max(max_path_delay, ta.report(n));
+
+			if (print_timing)
+				max_path_delay = std::max(max_path_delay, ta.report());
 
-		if (print_timing)
-			max_path_delay = ta.report();
+			if (hold_analysis)
+				min_hold_slack = std::min(min_hold_slack, ta.report_hold());
 
-		if (listnets)
-			for (auto &it : ta.net_max_path_delay)
-				fprintf(frpt, "%s\n", it.first.c_str());
+			if (listnets && corner == timing_corners.front())
+				for (auto &it : ta.net_max_path_delay)
+					fprintf(frpt, "%s\n", it.first.c_str());
+		}
+		else
+		{
+			max_path_delay = std::max(max_path_delay, ta.report());
+			if (hold_analysis)
+				min_hold_slack = std::min(min_hold_slack, ta.report_hold());
+		}
 	}
-	else
-	{
-		TimingAnalysis ta(interior_timing);
-		printf("// Timing estimate: %.2f ns (%.2f MHz)\n", ta.global_max_path_delay, 1000.0 / ta.global_max_path_delay);
-		max_path_delay = ta.report();
+
+	stats_phase_done("timing_analysis");
+
+	if (fjson) {
+		if (!json_firstentry)
+			fprintf(fjson, "  ]\n");
+		fprintf(fjson, "]\n");
+		fclose(fjson);
 	}
 
+	if (fstats)
+		fclose(fstats);
+
 	if (clock_constr > 0) {
 		printf("// Checking %.2f ns (%.2f MHz) clock constraint: ", 1000.0 / clock_constr, clock_constr);
 		if (max_path_delay <= 1000.0 / clock_constr) {
@@ -2638,12 +2905,15 @@ device_chip_mismatch:
 			printf("FAILED.\n");
 			return 1;
 		}
-	}
-
-	if (fjson) {
-		if (!json_firstentry)
-			fprintf(fjson, "  ]\n");
-		fprintf(fjson, "]\n");
+		if (hold_analysis) {
+			printf("// Checking hold slack: ");
+			if (min_hold_slack >= 0) {
+				printf("PASSED.\n");
+			} else {
+				printf("FAILED.\n");
+				return 1;
+			}
+		}
 	}
 
 	return 0;
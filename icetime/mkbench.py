@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# Generate synthetic .asc designs for benchmarking icetime.
+#
+# The designs are not functional circuits: a fraction <utilization> of the
+# logic tiles is used, and in each used tile the same fraction of logic
+# cells gets a random LUT/DFF configuration and the same fraction of input
+# muxes, output drivers and span switches is configured with a randomly
+# selected source. The chipdb is used to make sure that no net ends up with
+# more than one driver. This produces interconnect trees and timing graphs
+# of realistic size for each device without a synthesis and place&route flow.
+#
+# On the 5k, the four tiles of a DSP are used in the same way, configured as
+# a registered 16x16 multiplier (SB_MAC16_MUL_U_16X16_ALL_PIPELINE), so that
+# the designs also contain SB_MAC16 cells and their setup/hold checks.
+#
+# Usage: mkbench.py <chip> <utilization> <seed> <output.asc>
+#   chip: 384, 1k, 5k or 8k
+#   utilization: 0.0 .. 1.0
+#
+
+import sys, re, random
+sys.path.insert(0, "../icebox")
+import icebox
+
+if len(sys.argv) != 5:
+    print("Usage: %s <chip> <utilization> <seed> <output.asc>" % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+
+chip = sys.argv[1]
+utilization = float(sys.argv[2])
+random.seed(int(sys.argv[3]))
+
+ic = icebox.iceconfig()
+
+if chip == "384":
+    ic.setup_empty_384()
+elif chip == "1k":
+    ic.setup_empty_1k()
+elif chip == "5k":
+    ic.setup_empty_5k()
+elif chip == "8k":
+    ic.setup_empty_8k()
+else:
+    print("Unknown chip type '%s'." % chip, file=sys.stderr)
+    sys.exit(1)
+
+# x_y_name_net[(x, y, segment_name)] = net
+x_y_name_net = dict()
+driven_nets = set()
+
+# SB_MAC16 configuration bits (x, y, cbit_name) that are set, all others are cleared
+mac16_bits = set()
+
+with open("../icebox/chipdb-%s.txt" % chip, "r") as f:
+    net = None
+    mac16 = False
+    for line in f:
+        fields = line.split()
+        if len(fields) == 0 or fields[0].startswith("#"):
+            continue
+        if fields[0].startswith("."):
+            net = int(fields[1]) if fields[0] == ".net" else None
+            mac16 = fields[0] == ".extra_cell" and fields[-1] == "MAC16"
+            continue
+        if mac16 and fields[0] in ("A_REG", "BOTOUTPUT_SELECT_0", "BOTOUTPUT_SELECT_1"):
+            mac16_bits.add((int(fields[1]), int(fields[2]), fields[3]))
+        if net is not None:
+            x_y_name_net[(int(fields[0]), int(fields[1]), fields[2])] = net
+            if re.match(r"lutff_\d/(out|cout)$", fields[2]):
+                driven_nets.add(net)
+
+def apply_pattern(tile, bits):
+    for bit in bits:
+        value = "1"
+        if bit.startswith("!"):
+            value = "0"
+            bit = bit[1:]
+        row, col = bit[1:-1].split("[")
+        tile[int(row)][int(col)] = value
+
+def try_connect(x, y, entry):
+    src = x_y_name_net.get((x, y, entry[2]))
+    dst = x_y_name_net.get((x, y, entry[3]))
+    if dst is None or dst in driven_nets:
+        return False
+    if entry[1] == "routing" and src not in driven_nets:
+        return False
+    driven_nets.add(dst)
+    return True
+
+used_tiles = [pos for pos in sorted(ic.logic_tiles) if random.random() < utilization]
+dsp_tiles = dict()
+for (x, y) in sorted(ic.dsp_tiles[0]) if chip == "5k" else []:
+    if random.random() < utilization:
+        for i in range(4):
+            dsp_tiles[(x, y + i)] = ic.dsp_tiles[i]
+            used_tiles.append((x, y + i))
+tiles = dict()
+muxes = dict()
+
+for (x, y) in used_tiles:
+    tile_config = dsp_tiles[(x, y)] if (x, y) in dsp_tiles else ic.logic_tiles
+    tiles[(x, y)] = [list(line) for line in tile_config[(x, y)]]
+    muxes[(x, y)] = dict()
+
+    for entry in ic.tile_db(x, y):
+        if entry[1] == "IpConfig":
+            apply_pattern(tiles[(x, y)], [("" if (x, y, entry[2]) in mac16_bits else "!") + bit for bit in entry[0]])
+        elif entry[1].startswith("LC_") and (x, y) not in dsp_tiles:
+            # random LUT and carry config, DFF always enabled (LC bit 9) so
+            # that the design contains no combinational loops
+            if random.random() < utilization:
+                apply_pattern(tiles[(x, y)], [("" if random.random() < 0.5 else "!") + bit for bit in entry[0]])
+            apply_pattern(tiles[(x, y)], [entry[0][9]])
+        elif entry[1] in ("buffer", "routing") and entry[3] != "carry_in_mux" and \
+                not entry[2].endswith("/lout") and ic.tile_has_entry(x, y, entry):
+            muxes[(x, y)].setdefault((entry[1], entry[3]), list()).append(entry)
+
+# Buffers first (they drive span wires from logic cell outputs), then a few
+# rounds of span switches so that routing trees can grow across tiles.
+for kind, rounds in (("buffer", 1), ("routing", 3)):
+    for i in range(rounds):
+        for pos in random.sample(used_tiles, len(used_tiles)):
+            for key in sorted(muxes[pos]):
+                if key[0] != kind or random.random() >= utilization / rounds:
+                    continue
+                entry = random.choice(muxes[pos][key])
+                if try_connect(pos[0], pos[1], entry):
+                    apply_pattern(tiles[pos], entry[0])
+                    del muxes[pos][key]
+
+for pos in used_tiles:
+    tile_config = dsp_tiles[pos] if pos in dsp_tiles else ic.logic_tiles
+    tile_config[pos] = ["".join(line) for line in tiles[pos]]
+
+ic.write_file(sys.argv[4])
@@ -3,14 +3,37 @@
 import re
 
 print("// auto-generated by timings.py from ../icefuzz/timings_*.txt")
+print("")
+print("// select the value for the given min:typ:max corner (0, 1 or 2), or the worst")
+print("// case over all corners (3): the largest value, or the smallest for min-delays")
+print("static inline double corner_value(int corner, bool smallest, double v_min, double v_typ, double v_max)")
+print("{")
+print("  if (corner == 3)")
+print("    return smallest ? std::min(v_min, std::min(v_typ, v_max)) : std::max(v_min, std::max(v_typ, v_max));")
+print("  return corner == 0 ? v_min : corner == 1 ? v_typ : v_max;")
+print("}")
+
+def parse_triplet(text):
+    return [0 if s == "*" else float(s) / 1000 for s in text.split(":")]
+
+def triplet_to_c(values, smallest=False):
+    return "corner_value(corner, %s, %.5f, %.5f, %.5f)" % (("true" if smallest else "false",) + tuple(values))
 
 def timings_to_c(chip, f):
     print("")
-    print("double get_delay_%s(std::string cell_type, std::string in_port, std::string out_port)" % chip)
+    print("double get_delay_%s(std::string cell_type, std::string in_port, std::string out_port, int corner, bool min_delay)" % chip)
     print("{")
 
     in_cell = False
     last_cell = ""
+    hold_times = dict()
+
+    def print_hold_times():
+        # hold requirements are merged over both edges (worst case)
+        for inport in sorted(hold_times):
+            print("    if (in_port == \"%s\" && out_port == \"*hold*\") return %s;" % (inport, triplet_to_c(hold_times[inport])))
+        hold_times.clear()
+
     for line in f:
         fields = line.split()
         if len(fields) == 0:
@@ -18,11 +41,12 @@ def timings_to_c(chip, f):
 
         if fields[0] == "CELL":
             if in_cell:
+                print_hold_times()
                 if last_cell.startswith("SB_MAC16"):
                     # DSPs have incomplete timing specification, as some paths
                     # don't mathematically exist - e.g. there is no path from
                     # A[1] to O[0]
-                    print("    if (in_port != \"*clkedge*\" && out_port != \"*setup*\") return 0.0;")
+                    print("    if (in_port != \"*clkedge*\" && out_port != \"*setup*\" && out_port != \"*hold*\") return 0.0;")
                 print("  }")
             print("  if (cell_type == \"%s\") {" % fields[1])
             last_cell = fields[1]
@@ -30,19 +54,28 @@ def timings_to_c(chip, f):
 
         if fields[0] == "SETUP":
             inport = fields[1].split(":")[1]
-            delay = max([0 if s == "*" else float(s) / 1000 for s in fields[3].split(":")])
-            print("    if (in_port == \"%s\" && out_port == \"*setup*\") return %.5f;" % (inport, delay))
+            delays = parse_triplet(fields[3])
+            print("    if (in_port == \"%s\" && out_port == \"*setup*\") return %s;" % (inport, triplet_to_c(delays)))
+
+        if fields[0] == "HOLD":
+            inport = fields[1].split(":")[1]
+            delays = parse_triplet(fields[3])
+            hold_times[inport] = [max(a, b) for a, b in zip(delays, hold_times.get(inport, delays))]
 
         if fields[0] == "IOPATH":
             if fields[1].startswith("posedge:") or fields[1].startswith("negedge:"):
                 fields[1] = "*clkedge*"
-            delay = max([0 if s == "*" else float(s) / 1000 for s in fields[3].split(":") + fields[4].split(":")])
-            print("    if (in_port == \"%s\" && out_port == \"%s\") return %.5f;" % (fields[1], fields[2], delay))
+            rise_delays = parse_triplet(fields[3])
+            fall_delays = parse_triplet(fields[4])
+            min_delays = [min(a, b) for a, b in zip(rise_delays, fall_delays)]
+            max_delays = [max(a, b) for a, b in zip(rise_delays, fall_delays)]
+            print("    if (in_port == \"%s\" && out_port == \"%s\") return min_delay ? %s : %s;" % (fields[1], fields[2], triplet_to_c(min_delays, True), triplet_to_c(max_delays)))
 
 
     if in_cell:
+        print_hold_times()
         print("  }")
-    print("  if (in_port == \"*clkedge*\"|| out_port == \"*setup*\") return 0;")
+    print("  if (in_port == \"*clkedge*\"|| out_port == \"*setup*\" || out_port == \"*hold*\") return 0;")
     print("  fprintf(stderr, \"Unable to resolve delay for path %s -> %s in cell type %s!\\n\", in_port.c_str(), out_port.c_str(), cell_type.c_str());")
     print("  exit(1);")
     print("}")